@@ -0,0 +1,113 @@
+#ifndef INCLUDED_ACCUMULATORSTACK_H
+#define INCLUDED_ACCUMULATORSTACK_H
+
+#include <cassert>
+#include <vector>
+#include "NativeNet.h"
+#include "State.h"
+
+using namespace std;
+
+#define ACCUMULATOR_STACK_SIZE 128
+
+// The net's first-layer sums for every position on the current search path.
+// A push only records which piece moved; the sums of a position are built from
+// its nearest computed ancestor the first time it is evaluated, so interior
+// nodes that are never evaluated cost nothing and all leaves below a node
+// share its sums. Evaluating a leaf then costs one copy, two weight rows and
+// the tail of the net.
+class AccumulatorStack {
+  public:
+    AccumulatorStack() : m_net(NULL), m_size(0), m_overflow(0) {
+    }
+
+    // Each copy (e.g. a search thread's) builds its own stack on first reset.
+    AccumulatorStack(const AccumulatorStack&) : m_net(NULL), m_size(0), m_overflow(0) {
+    }
+
+    AccumulatorStack& operator=(const AccumulatorStack&) {
+      m_size = 0;
+      m_overflow = 0;
+      return *this;
+    }
+
+    // Starts a new path at `root`.
+    void reset(const State& root) {
+      if (!m_net) {
+        m_net = &getNativeNet();
+        m_levels.resize(ACCUMULATOR_STACK_SIZE);
+        for (auto& level : m_levels) {
+          m_net->initAccumulator(level.acc);
+        }
+      }
+      fann_type input[NNET_NUM_INPUTS];
+      root.getNeuralNetInput(input);
+      m_net->refreshAccumulator(input, m_levels[0].acc);
+      m_levels[0].key = root.getZobristHash();
+      m_levels[0].isComputed = true;
+      m_size = 1;
+      m_overflow = 0;
+    }
+
+    // Called with the board after `undo`'s move was made.
+    void push(const State& s, const Undo& undo) {
+      if (m_size == 0 || m_overflow > 0 || m_size == m_levels.size()) {
+        ++m_overflow;
+        return;
+      }
+      Level& level = m_levels[m_size++];
+      level.key = s.getZobristHash();
+      level.from = s.getCell(undo.from);
+      level.to = s.getCell(undo.to);
+      level.value = State::getNeuralNetValue(static_cast<Player>(undo.color));
+      level.isComputed = false;
+    }
+
+    void pop() {
+      if (m_overflow > 0) {
+        --m_overflow;
+      } else {
+        assert(m_size > 0);
+        --m_size;
+      }
+    }
+
+    // Net output for `s`. Falls back to a full forward pass when `s` is not
+    // the position on top of the stack.
+    fann_type evaluate(const State& s) {
+      if (m_size == 0 || m_overflow > 0 || m_levels[m_size - 1].key != s.getZobristHash()) {
+        fann_type input[NNET_NUM_INPUTS];
+        s.getNeuralNetInput(input);
+        return getNativeNet().run(input);
+      }
+      size_t i = m_size - 1;
+      while (!m_levels[i].isComputed) {
+        --i;
+      }
+      for (++i; i < m_size; ++i) {
+        Level& level = m_levels[i];
+        m_net->copyAccumulator(m_levels[i - 1].acc, level.acc);
+        m_net->updateAccumulator(level.acc, level.from, level.to, level.value);
+        level.isComputed = true;
+      }
+      return m_net->run(m_levels[m_size - 1].acc);
+    }
+
+  private:
+    struct Level {
+      Level() : key(0), from(0), to(0), value(0), isComputed(false) {}
+      Key_t key;
+      int from;
+      int to;
+      fann_type value;
+      bool isComputed;
+      NativeNet::Accumulator acc;
+    };
+
+    const NativeNet* m_net;
+    vector<Level> m_levels;
+    size_t m_size;
+    size_t m_overflow;
+};
+
+#endif
@@ -0,0 +1,143 @@
+#ifndef INCLUDED_BITBOARD_H
+#define INCLUDED_BITBOARD_H
+
+#include <cassert>
+#include <cstdint>
+#include <cstdlib>
+
+using namespace std;
+
+typedef uint64_t Bitboard_t;
+
+// Squares are laid out row-major with a fixed stride of 8, so both the 5x4 and
+// the 7x6 board fit in one word and every row has at least one padding column.
+// A piece stepping E off the last column or W off the first one lands on a
+// padding square, which is never part of BoardGeometry::squares.
+#define BOARD_STRIDE 8
+#define MAX_SQUARES 48
+#define MAX_WIN_MASKS 98
+#define MAX_CELLS 42
+// Identity, left-right, top-bottom and both: bit 0 flips x, bit 1 flips y.
+#define NUM_MIRRORS 4
+#define toSquare(x, y) (((y) - 1) * BOARD_STRIDE + ((x) - 1))
+#define squareX(sq) ((sq) % BOARD_STRIDE + 1)
+#define squareY(sq) ((sq) / BOARD_STRIDE + 1)
+#define squareBit(sq) (static_cast<Bitboard_t>(1) << (sq))
+
+static inline int popCount(const Bitboard_t b) {
+  return __builtin_popcountll(b);
+}
+
+static inline int lowestSquare(const Bitboard_t b) {
+  return __builtin_ctzll(b);
+}
+
+static inline Bitboard_t clearLowest(const Bitboard_t b) {
+  return b & (b - 1);
+}
+
+// Squares one step N, S, E or W of those in b, padding squares included.
+static inline Bitboard_t orthogonalNeighbours(const Bitboard_t b) {
+  return (b >> BOARD_STRIDE) | (b << BOARD_STRIDE) | (b << 1) | (b >> 1);
+}
+
+struct BoardGeometry {
+  int width;
+  int height;
+  Bitboard_t squares;
+  int numWinMasks;
+  Bitboard_t winMasks[MAX_WIN_MASKS];
+  // Maps a square to its y*width + x index, as used by Zobrist.h and getHash().
+  int denseIndex[MAX_SQUARES];
+  // The up to 8 squares touching a square, diagonals included.
+  Bitboard_t neighbours[MAX_SQUARES];
+  // Where each square goes under each mirror; -1 off the board.
+  int mirrorSquare[NUM_MIRRORS][MAX_SQUARES];
+  // Twice the area of the triangle on three cells (dense indices).
+  uint8_t triangleArea[MAX_CELLS][MAX_CELLS][MAX_CELLS];
+};
+
+static BoardGeometry makeBoardGeometry(const int width, const int height) {
+  BoardGeometry g;
+  g.width = width;
+  g.height = height;
+  g.squares = 0;
+  g.numWinMasks = 0;
+  for (int i = 0; i < MAX_SQUARES; ++i) {
+    g.denseIndex[i] = -1;
+    g.neighbours[i] = 0;
+  }
+  for (int y = 1; y <= height; ++y) {
+    for (int x = 1; x <= width; ++x) {
+      g.squares |= squareBit(toSquare(x, y));
+      g.denseIndex[toSquare(x, y)] = (y - 1) * width + (x - 1);
+    }
+  }
+
+  for (int m = 0; m < NUM_MIRRORS; ++m) {
+    for (int i = 0; i < MAX_SQUARES; ++i) {
+      g.mirrorSquare[m][i] = -1;
+    }
+    for (int y = 1; y <= height; ++y) {
+      for (int x = 1; x <= width; ++x) {
+        g.mirrorSquare[m][toSquare(x, y)] = toSquare((m & 1) ? width + 1 - x : x, (m & 2) ? height + 1 - y : y);
+      }
+    }
+  }
+
+  for (int y = 1; y <= height; ++y) {
+    for (int x = 1; x <= width; ++x) {
+      Bitboard_t n = 0;
+      for (int dy = -1; dy <= 1; ++dy) {
+        for (int dx = -1; dx <= 1; ++dx) {
+          const int nx = x + dx;
+          const int ny = y + dy;
+          if ((dx != 0 || dy != 0) && nx >= 1 && nx <= width && ny >= 1 && ny <= height) {
+            n |= squareBit(toSquare(nx, ny));
+          }
+        }
+      }
+      g.neighbours[toSquare(x, y)] = n;
+    }
+  }
+
+  const int numCells = width * height;
+  assert(numCells <= MAX_CELLS);
+  for (int a = 0; a < numCells; ++a) {
+    for (int b = 0; b < numCells; ++b) {
+      for (int c = 0; c < numCells; ++c) {
+        const int ax = a % width, ay = a / width;
+        const int bx = b % width, by = b / width;
+        const int cx = c % width, cy = c / width;
+        g.triangleArea[a][b][c] = static_cast<uint8_t>(abs(ax*(by-cy) + bx*(cy-ay) + cx*(ay-by)));
+      }
+    }
+  }
+
+  // every three-in-a-row: E, S, SE and SW from each starting square
+  const int dx[4] = { 1, 0, 1, -1 };
+  const int dy[4] = { 0, 1, 1, 1 };
+  for (int y = 1; y <= height; ++y) {
+    for (int x = 1; x <= width; ++x) {
+      for (int d = 0; d < 4; ++d) {
+        const int endX = x + 2*dx[d];
+        const int endY = y + 2*dy[d];
+        if (endX < 1 || endX > width || endY > height) continue;
+        assert(g.numWinMasks < MAX_WIN_MASKS);
+        g.winMasks[g.numWinMasks++] = squareBit(toSquare(x, y)) |
+                                      squareBit(toSquare(x + dx[d], y + dy[d])) |
+                                      squareBit(toSquare(endX, endY));
+      }
+    }
+  }
+  return g;
+}
+
+static const BoardGeometry& getBoardGeometry(const int width, const int height) {
+  static const BoardGeometry small = makeBoardGeometry(5, 4);
+  static const BoardGeometry large = makeBoardGeometry(7, 6);
+  assert((5 == width && 4 == height) || (7 == width && 6 == height));
+  return (7 == width && 6 == height) ? large : small;
+}
+
+#endif
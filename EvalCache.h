@@ -0,0 +1,82 @@
+#ifndef INCLUDED_EVALCACHE_H
+#define INCLUDED_EVALCACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "State.h"
+
+using namespace std;
+
+#define EVAL_CACHE_SIZE (1 << 16)
+// getGoodness depends on whose point of view it is scored from, which the
+// position key alone does not say.
+#define EVAL_CACHE_PLAYER_KEY 0x9E3779B97F4A7C15ULL
+
+// Direct-mapped cache of leaf evaluations, separate from the TT: a store always
+// replaces whatever shares its slot. Each Game owns one, so no locking.
+class EvalCache {
+  public:
+    EvalCache() : m_entries(EVAL_CACHE_SIZE), m_hits(0), m_misses(0) {
+    }
+
+    bool probe(const Key_t key, const Player player, int& value) {
+      const Entry& e = m_entries[index(key, player)];
+      if (e.isValid && e.key == mix(key, player)) {
+        value = e.value;
+        ++m_hits;
+        return true;
+      }
+      ++m_misses;
+      return false;
+    }
+
+    // Like probe, but doesn't count towards the hit rate.
+    bool contains(const Key_t key, const Player player) const {
+      const Entry& e = m_entries[index(key, player)];
+      return e.isValid && e.key == mix(key, player);
+    }
+
+    void store(const Key_t key, const Player player, const int value) {
+      Entry& e = m_entries[index(key, player)];
+      e.key = mix(key, player);
+      e.value = value;
+      e.isValid = true;
+    }
+
+    long long getHits() const {
+      return m_hits;
+    }
+
+    long long getMisses() const {
+      return m_misses;
+    }
+
+    void resetStats() {
+      m_hits = 0;
+      m_misses = 0;
+    }
+
+  private:
+    struct Entry {
+      Entry() : key(0), value(0), isValid(false) {}
+      Key_t key;
+      int32_t value;
+      bool isValid;
+    };
+
+    static Key_t mix(const Key_t key, const Player player) {
+      return player == Player::WHITE ? key : key ^ EVAL_CACHE_PLAYER_KEY;
+    }
+
+    static size_t index(const Key_t key, const Player player) {
+      return static_cast<size_t>(mix(key, player)) & (EVAL_CACHE_SIZE - 1);
+    }
+
+  private:
+    vector<Entry> m_entries;
+    long long m_hits;
+    long long m_misses;
+};
+
+#endif
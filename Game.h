@@ -1,17 +1,68 @@
 #ifndef INCLUDED_GAME_H
 #define INCLUDED_GAME_H
 
-#include <map>
+#include <atomic>
+#include <cstring>
+#include <memory>
 #include <random>
+#include <thread>
+#include "AccumulatorStack.h"
+#include "EvalCache.h"
+#include "MonteCarlo.h"
+#include "PositionHistory.h"
 #include "State.h"
+#include "Tablebase.h"
+#include "TranspositionTable.h"
 using namespace std;
 
 #define USE_AB_PRUNING 1
-static mt19937 rng(42);
+#define USE_PVS 1
+#define MAX_PLY 64
+#define NUM_KILLERS 2
+#define NUM_PACKED_MOVES (MAX_SQUARES * 4)
+#define TIME_CHECK_INTERVAL 1024
+#define NEXT_ITERATION_TIME_FRACTION 0.4
+// Half-width of the root window around the previous iteration's value, in
+// the units of the eval in use. Each fail widens that side by ASPIRATION_GROWTH.
+#ifdef USE_NEURALNET
+#define ASPIRATION_WINDOW (numeric_limits<int>::max() / 8)
+#else
+#define ASPIRATION_WINDOW 200
+#endif
+#define ASPIRATION_GROWTH 4
+// Plies a path may be searched past the nominal depth to answer threats.
+#define MAX_THREAT_EXTENSIONS 4
+#define DEFAULT_MC_TIME_BUDGET 9.0
+
+static_assert(MAX_PREDICTED_GOODNESS < numeric_limits<int>::max() - MAX_PLY, "net evaluations must not pass for mate scores");
+
+struct SearchInfo {
+  SearchInfo() : depth(0), nodes(0), seconds(0), failHighs(0), firstMoveFailHighs(0), researches(0), aspirationResearches(0) {}
+  int depth;
+  long long nodes;
+  double seconds;
+  // beta cutoffs, and how many of them the first move ordered produced
+  long long failHighs;
+  long long firstMoveFailHighs;
+  // null-window searches that failed high and were searched again
+  long long researches;
+  // root iterations repeated because the value fell outside the window
+  long long aspirationResearches;
+};
 
 class Game {
   public:
-    Game(const int width, const int height, const int maxDepth) : numTurns(0), maxDepth(maxDepth), currTurn(Player::WHITE), currState(State(width, height)) {
+    Game(const int width, const int height, const int maxDepth, const size_t ttSizeMb = DEFAULT_TT_SIZE_MB) : numTurns(0), maxDepth(maxDepth), searchDepth(maxDepth), numExtensions(0), timeBudget(0), searchAborted(false), abortAllowed(false), nodesSinceTimeCheck(0), numThreads(1), stopSignal(NULL), currTurn(Player::WHITE), currState(State(width, height)), transpositions(make_shared<TranspositionTable>(ttSizeMb)), useMonteCarlo(false) {
+#ifdef USE_MONTECARLO
+      useMonteCarlo = true;
+#endif
+#ifdef USE_NEURALNET
+      // load the net now rather than from the first leaf, on the move's clock
+      if (width == 5 && height == 4) {
+        getNetEvaluator();
+      }
+#endif
+      clearMoveOrdering();
     }
 
     bool move(const std::string& move, bool skipValidation = false) {
@@ -35,7 +86,7 @@ class Game {
         numTurns++;
         currTurn = OTHER(currTurn);
         currState.print();
-        history.push_back(currState);
+        positions.push(currState.getZobristHash());
       }
       return retval;
     }
@@ -61,124 +112,115 @@ class Game {
     }
 
     bool checkIsGameDrawn(const State& s) const {
-      int i = 0;
-      int numRepeat[2] = { 0, 0 };
-      for (const auto& state : history) {
-        if (s == state) {
-          numRepeat[i % 2]++;
-          if (numRepeat[0] == 3 || numRepeat[1] == 3) {
-            return true;
-          }
-        }
-        i++;
-      }
-      return false;
+      return positions.isRepeated(s.getZobristHash());
     }
 
     bool isDraw() const {
       return checkIsGameDrawn(currState);
     }
 
-    int playToEnd(State& s, const Player player, const int currDepth, int& leavesReached) {
-      const Player winner = s.getWinner();
-      if (winner != Player::NONE) {
-        leavesReached++;
-        return (player == winner ? 1 : -1) * numeric_limits<int>::max();
-      } else if (checkIsGameDrawn(s)) {
-        leavesReached++;
-        return 0;
+    shared_ptr<Move> getBestMoveMonteCarlo() {
+      if (!monteCarlo) {
+        monteCarlo = make_shared<MonteCarloTree>();
       }
+      const double budget = timeBudget > 0 ? timeBudget : DEFAULT_MC_TIME_BUDGET;
+      MonteCarloStats stats;
+      const Move move = monteCarlo->search(currState, budget, numThreads, monteCarloOptions, stats);
+      monteCarlo->printRoot(cout);
+      const double playoutsPerSecond = stats.playouts / max(stats.seconds, 1e-9);
+      cout << "playouts: " << stats.playouts << ", playouts/s: " << playoutsPerSecond;
+      if (stats.numThreads > 1) {
+        cout << ", threads: " << stats.numThreads << ", playouts/s per thread: " << playoutsPerSecond / stats.numThreads;
+      }
+      if (stats.netEvaluations > 0) {
+        cout << ", net evaluations: " << stats.netEvaluations;
+      }
+      cout << ", nodes: " << stats.nodes << ", reused visits: " << stats.reusedVisits << endl;
+      lastSearch.nodes = stats.playouts;
+      lastSearch.seconds = stats.seconds;
+      return move.isNull() ? NULL : make_shared<Move>(move);
+    }
 
-      vector<Move> moves = s.getMoves(s.getCurrTurn());
-      uniform_int_distribution<int> uni(0, (int)moves.size());
-      const int index = uni(rng);
-      pushState(s);
-
-      Move move = moves[index];
-      s.move(move.x, move.y, move.dir, false);
-      int goodness = playToEnd(s, player, currDepth, leavesReached);
-      s = popState();
-      return goodness;
+    void setUseMonteCarlo(const bool use) {
+      useMonteCarlo = use;
     }
 
-    shared_ptr<Move> getBestMoveMonteCarlo() {
-      int leavesReached = 0;
-      clock_t startTime = clock();
-      const vector<Move> moves = currState.getMoves(currTurn);
-      map<Move, int> goodnessMap;
-      uniform_int_distribution<int> uni(0, (int)moves.size()-1);
-      while (true) {
-        const double elapsedTime = ((clock() - startTime)/(double)CLOCKS_PER_SEC);
-        if (elapsedTime > 9.0) break;
+    void setMonteCarloOptions(const MonteCarloOptions& options) {
+      monteCarloOptions = options;
+      if (options.useNet && currState.getWidth() == 5 && currState.getHeight() == 4) {
+        getNetEvaluator();
+      }
+    }
 
-        pushState(currState);
+    void setTimeBudget(const double seconds) {
+      timeBudget = seconds;
+    }
 
-        const int index = uni(rng);
-        const Move move = moves[index];
+    void setNumThreads(const int n) {
+      numThreads = max(1, n);
+    }
 
-        currState.move(move.x, move.y, move.dir, true);
+    void setTablebase(const shared_ptr<const Tablebase>& tb) {
+      tablebase = tb;
+    }
 
-        const int goodness = playToEnd(currState, currTurn, 10, leavesReached);
-        if (goodnessMap.find(move) == goodnessMap.end()) {
-          goodnessMap[move] = 0;
-        }
-        goodnessMap[move] += goodness;
+    const SearchInfo& getLastSearch() const {
+      return lastSearch;
+    }
 
-        currState = popState();
+    shared_ptr<Move> getBestMove() {
+      if (useMonteCarlo) {
+        return getBestMoveMonteCarlo();
+      }
+      transpositions->newSearch();
+      lastSearch = SearchInfo();
+      evalCache.resetStats();
+      stopwatch.reset();
+      searchAborted = false;
+      MoveList moves = currState.getMoves(currTurn);
+      shared_ptr<Move> tablebaseMove;
+      if (probeTablebase(moves, tablebaseMove)) {
+        return tablebaseMove;
       }
-      cout << "leaves reached: " << leavesReached << endl;
 
-      shared_ptr<Move> bestMove;
-      int bestValue = -numeric_limits<int>::max();
-      for (const auto& p : goodnessMap) {
-        cout << "goodness: " << p.second << endl;
-        if (p.second > bestValue) {
-          bestValue = p.second;
-          bestMove = make_shared<Move>(p.first);
-        }
+      // Lazy SMP: helpers search the same root with their own stacks and move
+      // orders and only talk to each other through the shared TT.
+      atomic<bool> stopHelpers(false);
+      vector< shared_ptr<Game> > helpers;
+      vector<thread> threads;
+      for (int i = 1; i < numThreads; ++i) {
+        helpers.push_back(make_shared<Game>(*this));
+        threads.push_back(thread(&Game::runHelper, helpers.back().get(), moves, i, &stopHelpers));
       }
-      return bestMove;
-    }
 
-    shared_ptr<Move> getBestMove() {
-#ifdef USE_MONTECARLO
-      return getBestMoveMC();
-#endif
-      vector<Move> moves = currState.getMoves(currTurn);
-      shared_ptr<Move> bestMove;
-      int goodness = 0;
       int bestWorst = -numeric_limits<int>::max();
       int numExpanded = 0;
-      for (auto& move : moves) {
-        pushState(currState);
-
-        currState.move(move.x, move.y, move.dir, true);
-        if (currState.hasPlayerWon(currTurn)) {
-          bestMove = make_shared<Move>(move);
-          bestWorst = numeric_limits<int>::max();
-          currState = popState();
-          break;
-        } else {
-#ifdef USE_MINIMAX
-          goodness = (currTurn == Player::BLACK ? -1 : 1) * minimax(currState, maxDepth, -numeric_limits<int>::max(), numeric_limits<int>::max(), numExpanded);
-#else
-          goodness = negamax(currState, currTurn, maxDepth, -numeric_limits<int>::max(), -bestWorst, numExpanded);
+      shared_ptr<Move> bestMove = iterativeDeepening(moves, 1, bestWorst, numExpanded, true);
+
+      stopHelpers = true;
+      lastSearch.nodes = numExpanded;
+      for (size_t i = 0; i < threads.size(); ++i) {
+        threads[i].join();
+        lastSearch.nodes += helpers[i]->lastSearch.nodes;
+        lastSearch.failHighs += helpers[i]->lastSearch.failHighs;
+        lastSearch.firstMoveFailHighs += helpers[i]->lastSearch.firstMoveFailHighs;
+        lastSearch.researches += helpers[i]->lastSearch.researches;
+        lastSearch.aspirationResearches += helpers[i]->lastSearch.aspirationResearches;
+      }
+      lastSearch.seconds = stopwatch.elapsed();
+      const long long evalProbes = max(1LL, evalCache.getHits() + evalCache.getMisses());
+      cout << "bestWorst: " << bestWorst << ", numExpanded: " << numExpanded
+           << ", evalCache hits: " << evalCache.getHits() << ", misses: " << evalCache.getMisses()
+           << " (" << 100.0 * evalCache.getHits() / evalProbes << "%)" << endl;
+#ifndef USE_MINIMAX
+      cout << "failHighs: " << lastSearch.failHighs << " ("
+           << 100.0 * lastSearch.firstMoveFailHighs / max(1LL, lastSearch.failHighs) << "% on the first move)"
+           << ", re-searches: " << lastSearch.researches << ", aspiration re-searches: " << lastSearch.aspirationResearches << endl;
 #endif
-
-          cout << move.toString() << ", goodness: " << goodness << endl;
-          if (goodness > bestWorst) {
-            bestWorst = goodness;
-            bestMove = make_shared<Move>(move);
-          } else if (goodness == bestWorst) {
-            if (find(history.begin(), history.end(), currState) == history.end() || rand() % 2 == 0) {
-              bestMove = make_shared<Move>(move);
-            }
-          }
-        }
-
-        currState = popState();
+      if (numThreads > 1) {
+        cout << "threads: " << numThreads << ", totalExpanded: " << lastSearch.nodes
+             << ", nodes/s: " << lastSearch.nodes / max(lastSearch.seconds, 1e-9) << endl;
       }
-      cout << "bestWorst: " << bestWorst << ", numExpanded: " << numExpanded << endl;
 
       return bestMove;
     }
@@ -198,20 +240,20 @@ class Game {
         return s.getGoodness(Player::WHITE);
       }
       int v = -numeric_limits<int>::max();
-      vector<Move> moves = s.getMoves(s.getCurrTurn());
+      MoveList moves = s.getMoves(s.getCurrTurn());
       for (const auto& move : moves) {
-        pushState(s);
-        s.move(move.x, move.y, move.dir, true);
+        Undo undo;
+        pushState(s, move, undo);
 
         v = max(v, minValue(s, currDepth-1, alpha, beta, numExpanded));
 #if USE_AB_PRUNING
         if (v >= beta) {
-          s = popState();
+          popState(s, undo);
           return v;
         }
 #endif
         alpha = max(alpha, v);
-        s = popState();
+        popState(s, undo);
       }
       return v;
     }
@@ -227,118 +269,528 @@ class Game {
         return s.getGoodness(Player::WHITE);
       }
       int v = numeric_limits<int>::max();
-      vector<Move> moves = s.getMoves(s.getCurrTurn());
+      MoveList moves = s.getMoves(s.getCurrTurn());
       for (const auto& move : moves) {
-        pushState(s);
-        s.move(move.x, move.y, move.dir, true);
+        Undo undo;
+        pushState(s, move, undo);
 
         v = min(v, maxValue(s, currDepth-1, alpha, beta, numExpanded));
 #if USE_AB_PRUNING
         if (v <= alpha) {
-          s = popState();
+          popState(s, undo);
           return v;
         }
 #endif
         beta = min(beta, v);
-        s = popState();
+        popState(s, undo);
       }
       return v;
     }
 
     int negamax(State& s, const Player player, const int currDepth, int alpha, int beta, int& numExpanded) {
+      if (isOutOfTime()) {
+        return 0;
+      }
       const int alphaOrig = alpha;
-      const Hash_t hash = s.getHash();
-      const auto& it = stateMap.find(hash);
-      if (it != stateMap.end()) {
-        if (abs(it->second.bestValue) > 100000) {
-          return it->second.bestValue;
-        } else if (it->second.depth >= currDepth) {
-          if (it->second.flag == Flag::EXACT) {
-            return it->second.bestValue;
-          } else if (it->second.flag == Flag::LOWERBOUND) {
-            alpha = max(alpha, it->second.bestValue);
-          } else if (it->second.flag == Flag::UPPERBOUND) {
-            beta = min(beta, it->second.bestValue);
+      // Mirror images share one entry, stored in the orientation of the image
+      // with the lowest key.
+      int symmetry = 0;
+      const Key_t key = s.getCanonicalKey(symmetry);
+      const int rootDistance = searchDepth - currDepth + numExtensions;
+      const int ply = min(rootDistance, MAX_PLY - 1);
+      uint8_t hashMove = NO_MOVE;
+      Data entry;
+      // Stored values and flags are from the point of view of `player`, while
+      // alpha and beta are from the point of view of the side to move.
+      if (transpositions->probe(key, entry)) {
+        hashMove = s.transformMove(entry.bestMove, symmetry);
+        if (isDecided(entry.bestValue) &&
+            (entry.bestValue > 0 ? entry.flag != Flag::UPPERBOUND : entry.flag != Flag::LOWERBOUND)) {
+          return entry.bestValue;
+        } else if (entry.depth >= currDepth) {
+          if (entry.flag == Flag::EXACT) {
+            return entry.bestValue;
+          } else if (entry.flag == Flag::LOWERBOUND) {
+            beta = min(beta, -entry.bestValue);
+          } else if (entry.flag == Flag::UPPERBOUND) {
+            alpha = max(alpha, -entry.bestValue);
           }
           if (alpha > beta) {
-            return it->second.bestValue;
+            return entry.bestValue;
           }
         }
       }
       if (s.hasPlayerWon(player)) {
-        return numeric_limits<int>::max() + currDepth - maxDepth;
+        return numeric_limits<int>::max() - rootDistance;
       }
       else if (s.hasPlayerWon(OTHER(player))) {
-        return -(numeric_limits<int>::max() + currDepth - maxDepth);
+        return -(numeric_limits<int>::max() - rootDistance);
       } else if (checkIsGameDrawn(s)) {
         return 0;
       } else if (currDepth == 0) {
-        return s.getGoodness(player);
+        // The horizon isn't quiet while a line can be completed in one move:
+        // the side to move wins outright, or must answer the threat, which
+        // is searched one ply further.
+        if (s.hasWinningMove(OTHER(player))) {
+          return -(numeric_limits<int>::max() - (rootDistance + 1));
+        } else if (numExtensions < MAX_THREAT_EXTENSIONS && s.hasWinningMove(player)) {
+          ++numExtensions;
+#if defined(USE_NEURALNET) && !defined(USE_NNUE)
+          // the extension batches its own leaves over the batch of this
+          // node's siblings, which is still needed once it returns
+          const LeafBatch siblings = leafBatch;
+#endif
+          const int value = negamax(s, player, 1, alpha, beta, numExpanded);
+#if defined(USE_NEURALNET) && !defined(USE_NNUE)
+          leafBatch = siblings;
+#endif
+          --numExtensions;
+          return value;
+        }
+        return evaluate(s, player);
       }
       else {
         // now it's the other player's turn
         int bestVal = -numeric_limits<int>::max();
-        vector<Move> moves = s.getMoves(OTHER(player));
-        for (auto& move : moves) {
-          pushState(s);
-
-          s.move(move.x, move.y, move.dir, true);
-          int goodness = negamax(s, OTHER(player), currDepth-1, -beta, -alpha, ++numExpanded);
+        uint8_t bestMove = NO_MOVE;
+        MoveList moves = s.getMoves(OTHER(player));
+        orderMoves(moves, OTHER(player), ply, hashMove);
+#if defined(USE_NEURALNET) && !defined(USE_NNUE)
+        if (currDepth == 1) {
+          evaluateLeaves(s, moves, OTHER(player));
+        }
+#endif
+        for (size_t i = 0; i < moves.size(); ++i) {
+          const Move& move = moves[i];
+          Undo undo;
+          pushState(s, move, undo);
+          int goodness;
+#if USE_AB_PRUNING && USE_PVS
+          // Later moves only have to be shown no better than alpha, which a
+          // null window does cheaply. One that fails high inside the window
+          // is searched again for its exact value.
+          if (i > 0) {
+            goodness = negamax(s, OTHER(player), currDepth-1, -alpha, -alpha, ++numExpanded);
+            if (goodness > alpha && goodness <= beta && !searchAborted) {
+              ++lastSearch.researches;
+              goodness = negamax(s, OTHER(player), currDepth-1, -beta, -alpha, ++numExpanded);
+            }
+          } else
+#endif
+          {
+            goodness = negamax(s, OTHER(player), currDepth-1, -beta, -alpha, ++numExpanded);
+          }
           if (goodness > bestVal) {
             bestVal = goodness;
+            bestMove = move.pack();
           }
 
-          s = popState();
+          popState(s, undo);
+          if (searchAborted) {
+            return 0;
+          }
 
 #if USE_AB_PRUNING
           if (bestVal > beta) {
+            ++lastSearch.failHighs;
+            if (i == 0) {
+              ++lastSearch.firstMoveFailHighs;
+            }
+            updateMoveOrdering(OTHER(player), ply, currDepth, bestMove, hashMove);
             break;
           }
+          alpha = max(alpha, bestVal);
 #endif
         }
 
         Data d;
         d.bestValue = -bestVal;
         d.depth = currDepth;
-        if (d.bestValue <= alphaOrig) {
-          d.flag = Flag::UPPERBOUND;
-        } else if (d.bestValue >= beta) {
+        d.bestMove = s.transformMove(bestMove, symmetry);
+        if (bestVal < alphaOrig) {
           d.flag = Flag::LOWERBOUND;
+        } else if (bestVal > beta) {
+          d.flag = Flag::UPPERBOUND;
         } else {
           d.flag = Flag::EXACT;
         }
-        stateMap[hash] = d;
+        transpositions->store(key, d);
 
         return -bestVal;
       }
     }
 
-    void setStateMap(const StateMap_t& stateMap) {
-      this->stateMap = stateMap;
+    void setSavedState(const State& s, Data d) {
+      int symmetry = 0;
+      const Key_t key = s.getCanonicalKey(symmetry);
+      d.bestMove = s.transformMove(d.bestMove, symmetry);
+      transpositions->store(key, d);
     }
 
-    const StateMap_t& getStateMap() const {
-      return stateMap;
+    bool probe(const State& s, Data& d) const {
+      int symmetry = 0;
+      if (!transpositions->probe(s.getCanonicalKey(symmetry), d)) {
+        return false;
+      }
+      d.bestMove = s.transformMove(d.bestMove, symmetry);
+      return true;
     }
 
   private:
-    void pushState(const State& s) {
-      history.push_back(s);
+    shared_ptr<Move> iterativeDeepening(MoveList moves, const int firstDepth, int& bestWorst, int& numExpanded, const bool verbose) {
+      shared_ptr<Move> bestMove;
+      lastSearch.depth = 0;
+      for (int depth = firstDepth; depth <= maxDepth; ++depth) {
+        shared_ptr<Move> iterationMove;
+        // Aspiration: search a window around the last value first, and widen
+        // the side it falls out of when it does, all the way for a mate.
+        // Minimax has no window.
+        int alpha = -numeric_limits<int>::max();
+        int beta = numeric_limits<int>::max();
+        long long window = ASPIRATION_WINDOW;
+#ifndef USE_MINIMAX
+        if (bestMove && !isDecided(bestWorst)) {
+          alpha = max(static_cast<long long>(alpha), bestWorst - window);
+          beta = min(static_cast<long long>(beta), bestWorst + window);
+        }
+#endif
+        int iterationValue = searchRoot(moves, depth, alpha, beta, iterationMove, numExpanded);
+        while (!searchAborted && (iterationValue < alpha || iterationValue > beta)) {
+          ++lastSearch.aspirationResearches;
+          window *= ASPIRATION_GROWTH;
+          if (isDecided(iterationValue)) {
+            window = numeric_limits<int>::max();
+          }
+          if (iterationValue < alpha) {
+            alpha = max(-static_cast<long long>(numeric_limits<int>::max()), bestWorst - window);
+          } else {
+            beta = min(static_cast<long long>(numeric_limits<int>::max()), bestWorst + window);
+          }
+          iterationMove.reset();
+          iterationValue = searchRoot(moves, depth, alpha, beta, iterationMove, numExpanded);
+        }
+        if (searchAborted || !iterationMove) {
+          break;
+        }
+        bestMove = iterationMove;
+        bestWorst = iterationValue;
+        lastSearch.depth = depth;
+        if (verbose) {
+          cout << "depth: " << depth << ", best: " << bestMove->toString() << ", bestWorst: " << bestWorst
+               << ", numExpanded: " << numExpanded << ", elapsed: " << stopwatch.elapsed() << "s" << endl;
+        }
+        if (isDecided(bestWorst)) {
+          break;
+        }
+        // an iteration costs several times the previous one, so don't start one we can't finish
+        if (timeBudget > 0 && stopwatch.elapsed() > timeBudget * NEXT_ITERATION_TIME_FRACTION) {
+          break;
+        }
+        // search the previous best move first so the root window is tight early
+        for (size_t i = 0; i < moves.size(); ++i) {
+          if (moves[i] == *bestMove) {
+            rotate(moves.begin(), moves.begin() + i, moves.begin() + i + 1);
+            break;
+          }
+        }
+      }
+      return bestMove;
     }
 
-    State popState() {
-      State s = history.back();
-      history.pop_back();
-      return s;
+    // Helper threads start on alternating depths with shuffled root moves, so
+    // they fill the TT with different subtrees, and run until told to stop.
+    void runHelper(MoveList moves, const int index, const atomic<bool>* stop) {
+      stopSignal = stop;
+      timeBudget = 0;
+      searchAborted = false;
+      mt19937 helperRng(index);
+      shuffle(moves.begin(), moves.end(), helperRng);
+      int bestWorst = -numeric_limits<int>::max();
+      int numExpanded = 0;
+      iterativeDeepening(moves, 1 + index % 2, bestWorst, numExpanded, false);
+      lastSearch.nodes = numExpanded;
+    }
+
+    // Searches the root moves to `depth` and returns the best worst-case value.
+    // A value below alpha is only an upper bound, and above beta only a lower
+    // bound; the search stops at the first move that beats beta. Minimax
+    // always gets the full window.
+    int searchRoot(const MoveList& moves, const int depth, const int alpha, const int beta, shared_ptr<Move>& bestMove, int& numExpanded) {
+      searchDepth = depth;
+#ifdef USE_NNUE
+      if (usesNnue(currState)) {
+        accumulators.reset(currState);
+      }
+#endif
+      // the first iteration always completes so there is a move to fall back on
+      abortAllowed = depth > 1 || stopSignal != NULL;
+      int goodness = 0;
+      int bestWorst = -numeric_limits<int>::max();
+      for (auto& move : moves) {
+        Undo undo;
+        pushState(currState, move, undo);
+        if (currState.hasPlayerWon(currTurn)) {
+          bestMove = make_shared<Move>(move);
+          bestWorst = numeric_limits<int>::max();
+          popState(currState, undo);
+          break;
+        } else {
+#ifdef USE_MINIMAX
+          goodness = (currTurn == Player::BLACK ? -1 : 1) * minimax(currState, depth, -numeric_limits<int>::max(), numeric_limits<int>::max(), numExpanded);
+#else
+          const int lower = max(alpha, bestWorst);
+#if USE_AB_PRUNING && USE_PVS
+          if (bestMove) {
+            goodness = negamax(currState, currTurn, depth, -lower, -lower, numExpanded);
+            if (goodness > lower && goodness <= beta && !searchAborted) {
+              ++lastSearch.researches;
+              goodness = negamax(currState, currTurn, depth, -beta, -lower, numExpanded);
+            }
+          } else
+#endif
+          {
+            goodness = negamax(currState, currTurn, depth, -beta, -lower, numExpanded);
+          }
+#endif
+          if (searchAborted) {
+            popState(currState, undo);
+            break;
+          }
+
+          if (goodness > bestWorst) {
+            bestWorst = goodness;
+            bestMove = make_shared<Move>(move);
+            if (bestWorst > beta) {
+              popState(currState, undo);
+              break;
+            }
+          } else if (goodness == bestWorst) {
+            if (!positions.contains(currState.getZobristHash()) || rand() % 2 == 0) {
+              bestMove = make_shared<Move>(move);
+            }
+          }
+        }
+
+        popState(currState, undo);
+      }
+      return bestWorst;
+    }
+
+    // Polls the clock and the stop signal every TIME_CHECK_INTERVAL nodes once
+    // aborting is allowed.
+    bool isOutOfTime() {
+      if (searchAborted) {
+        return true;
+      }
+      if (!abortAllowed || (++nodesSinceTimeCheck % TIME_CHECK_INTERVAL) != 0) {
+        return false;
+      }
+      searchAborted = (stopSignal && stopSignal->load(memory_order_relaxed)) ||
+                      (timeBudget > 0 && stopwatch.elapsed() > timeBudget);
+      return searchAborted;
+    }
+
+    static bool isDecided(const int value) {
+      return abs(value) >= numeric_limits<int>::max() - MAX_PLY;
+    }
+
+    void clearMoveOrdering() {
+      memset(killers, NO_MOVE, sizeof(killers));
+      memset(historyScores, 0, sizeof(historyScores));
+    }
+
+    // Hash move first, then killers for this ply, then by history score.
+    void orderMoves(MoveList& moves, const Player player, const int ply, const uint8_t hashMove) const {
+      int scores[NUM_PACKED_MOVES];
+      for (size_t i = 0; i < moves.size(); ++i) {
+        const uint8_t m = moves[i].pack();
+        if (m == hashMove) {
+          scores[i] = numeric_limits<int>::max();
+        } else if (m == killers[ply][0]) {
+          scores[i] = numeric_limits<int>::max() - 1;
+        } else if (m == killers[ply][1]) {
+          scores[i] = numeric_limits<int>::max() - 2;
+        } else {
+          scores[i] = historyScores[player][m];
+        }
+      }
+      for (size_t i = 1; i < moves.size(); ++i) {
+        const Move move = moves[i];
+        const int score = scores[i];
+        size_t j = i;
+        for (; j > 0 && scores[j-1] < score; --j) {
+          moves[j] = moves[j-1];
+          scores[j] = scores[j-1];
+        }
+        moves[j] = move;
+        scores[j] = score;
+      }
+    }
+
+    void updateMoveOrdering(const Player player, const int ply, const int currDepth, const uint8_t move, const uint8_t hashMove) {
+      if (move != hashMove && move != killers[ply][0]) {
+        killers[ply][1] = killers[ply][0];
+        killers[ply][0] = move;
+      }
+      historyScores[player][move] = min(historyScores[player][move] + currDepth * currDepth, numeric_limits<int>::max() / 2);
+    }
+
+    // Transpositions reach the same leaves many times, so leaf values are
+    // cached by key.
+    int evaluate(const State& s, const Player player) {
+      const Key_t key = s.getZobristHash();
+      int value;
+      if (evalCache.probe(key, player, value)) {
+        return value;
+      }
+      value = computeEvaluation(s, player);
+      evalCache.store(key, player, value);
+      return value;
+    }
+
+    int computeEvaluation(const State& s, const Player player) {
+#ifdef USE_NNUE
+      if (usesNnue(s)) {
+        return State::getPredictedGoodness(accumulators.evaluate(s), player);
+      }
+#elif defined(USE_NEURALNET)
+      const Key_t key = s.getZobristHash();
+      for (int i = 0; i < leafBatch.size; ++i) {
+        if (leafBatch.keys[i] == key) {
+          return leafBatch.values[i];
+        }
+      }
+#endif
+      return s.getGoodness(player);
+    }
+
+#ifdef USE_NNUE
+    static bool usesNnue(const State& s) {
+      return s.getWidth() == 5 && s.getHeight() == 4;
+    }
+#endif
+
+#if defined(USE_NEURALNET) && !defined(USE_NNUE)
+    // All children of a depth-1 node are leaves, so the net evaluations of
+    // those not already cached are computed in one batched forward pass
+    // before the children are visited.
+    void evaluateLeaves(State& s, const MoveList& moves, const Player player) {
+      leafBatch.size = 0;
+      if (!(s.getWidth() == 5 && s.getHeight() == 4)) {
+        return;
+      }
+      fann_type inputs[MAX_MOVES * NNET_NUM_INPUTS];
+      for (const auto& move : moves) {
+        Undo undo;
+        s.makeMove(move, undo);
+        if (!s.hasPlayerWon(player) && !s.hasPlayerWon(OTHER(player)) &&
+            !evalCache.contains(s.getZobristHash(), player)) {
+          s.getNeuralNetInput(&inputs[leafBatch.size * NNET_NUM_INPUTS]);
+          leafBatch.keys[leafBatch.size++] = s.getZobristHash();
+        }
+        s.unmakeMove(undo);
+      }
+      fann_type preds[MAX_MOVES];
+      getNetEvaluator().runBatch(inputs, leafBatch.size, preds);
+      for (int i = 0; i < leafBatch.size; ++i) {
+        leafBatch.values[i] = State::getPredictedGoodness(preds[i], player);
+      }
+    }
+#endif
+
+    // With the position in the tablebase, a won or lost root is played out
+    // from the table alone: the fastest win, or the slowest loss. A drawn root
+    // is left to the search, restricted to the moves that keep the draw.
+    bool probeTablebase(MoveList& moves, shared_ptr<Move>& bestMove) {
+      if (!tablebase || !Tablebase::covers(currState) || moves.size() == 0) {
+        return false;
+      }
+      const uint8_t rootValue = tablebase->probe(currState);
+      MoveList drawing;
+      int bestDistance = 0;
+      for (const auto& move : moves) {
+        Undo undo;
+        currState.makeMove(move, undo);
+        const uint8_t value = tablebase->probe(currState);
+        currState.unmakeMove(undo);
+        // value is from the opponent's point of view
+        if (Tablebase::isWin(rootValue) && Tablebase::isLoss(value)) {
+          if (!bestMove || Tablebase::getDistance(value) < bestDistance) {
+            bestMove = make_shared<Move>(move);
+            bestDistance = Tablebase::getDistance(value);
+          }
+        } else if (Tablebase::isLoss(rootValue)) {
+          if (!bestMove || Tablebase::getDistance(value) > bestDistance) {
+            bestMove = make_shared<Move>(move);
+            bestDistance = Tablebase::getDistance(value);
+          }
+        } else if (value == TABLEBASE_DRAW) {
+          drawing.push_back(move);
+        }
+      }
+      if (bestMove) {
+        cout << "tablebase: " << (Tablebase::isWin(rootValue) ? "win" : "loss") << " in "
+             << Tablebase::getDistance(rootValue) << " plies" << endl;
+        return true;
+      }
+      if (rootValue == TABLEBASE_DRAW && drawing.size() > 0) {
+        cout << "tablebase: draw, " << drawing.size() << " of " << moves.size() << " moves hold it" << endl;
+        moves = drawing;
+      }
+      return false;
+    }
+
+    void pushState(State& s, const Move& move, Undo& undo) {
+      positions.push(s.getZobristHash());
+      s.makeMove(move, undo);
+#ifdef USE_NNUE
+      accumulators.push(s, undo);
+#endif
+    }
+
+    void popState(State& s, const Undo& undo) {
+#ifdef USE_NNUE
+      accumulators.pop();
+#endif
+      s.unmakeMove(undo);
+      positions.pop();
     }
 
   private:
     int numTurns;
     int maxDepth;
+    int searchDepth;
+    // threat extensions on the path to the current node
+    int numExtensions;
+    double timeBudget;
+    bool searchAborted;
+    bool abortAllowed;
+    unsigned int nodesSinceTimeCheck;
+    Stopwatch stopwatch;
+    int numThreads;
+    const atomic<bool>* stopSignal;
+    SearchInfo lastSearch;
     State currState;
     Player currTurn;
-    vector<State> history;
-    StateMap_t stateMap;
+    PositionHistory positions;
+    shared_ptr<TranspositionTable> transpositions;
+    shared_ptr<const Tablebase> tablebase;
+    bool useMonteCarlo;
+    MonteCarloOptions monteCarloOptions;
+    shared_ptr<MonteCarloTree> monteCarlo;
+    EvalCache evalCache;
+    uint8_t killers[MAX_PLY][NUM_KILLERS];
+    int historyScores[2][NUM_PACKED_MOVES];
+#ifdef USE_NNUE
+    AccumulatorStack accumulators;
+#elif defined(USE_NEURALNET)
+    struct LeafBatch {
+      LeafBatch() : size(0) {}
+      Key_t keys[MAX_MOVES];
+      int values[MAX_MOVES];
+      int size;
+    } leafBatch;
+#endif
 };
 
 
@@ -0,0 +1,90 @@
+#ifndef INCLUDED_MAPPEDFILE_H
+#define INCLUDED_MAPPEDFILE_H
+
+#include <cstddef>
+#include <fcntl.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+// A whole file mapped read-only. Pages are read in on first touch, so opening
+// costs the same for any file size, and processes mapping the same file share
+// its pages. The mapping stays valid if the file is replaced by a rename.
+class MappedFile {
+  public:
+    MappedFile() : m_data(NULL), m_size(0) {
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    MappedFile(MappedFile&& other) : m_data(other.m_data), m_size(other.m_size) {
+      other.m_data = NULL;
+      other.m_size = 0;
+    }
+
+    MappedFile& operator=(MappedFile&& other) {
+      if (this != &other) {
+        close();
+        m_data = other.m_data;
+        m_size = other.m_size;
+        other.m_data = NULL;
+        other.m_size = 0;
+      }
+      return *this;
+    }
+
+    ~MappedFile() {
+      close();
+    }
+
+    bool open(const string& fileName) {
+      close();
+      const int fd = ::open(fileName.c_str(), O_RDONLY);
+      if (fd < 0) {
+        return false;
+      }
+      struct stat st;
+      if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        ::close(fd);
+        return false;
+      }
+      void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+      ::close(fd);
+      if (p == MAP_FAILED) {
+        return false;
+      }
+      m_data = static_cast<const char*>(p);
+      m_size = st.st_size;
+      return true;
+    }
+
+    void close() {
+      if (m_data) {
+        munmap(const_cast<char*>(m_data), m_size);
+        m_data = NULL;
+        m_size = 0;
+      }
+    }
+
+    bool isOpen() const {
+      return m_data != NULL;
+    }
+
+    const char* data() const {
+      return m_data;
+    }
+
+    size_t size() const {
+      return m_size;
+    }
+
+  private:
+    const char* m_data;
+    size_t m_size;
+};
+
+#endif
@@ -0,0 +1,432 @@
+#ifndef INCLUDED_MONTECARLO_H
+#define INCLUDED_MONTECARLO_H
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+#include "State.h"
+
+using namespace std;
+
+#define MCTS_MAX_NODES (1 << 20)
+#define MCTS_EXPLORATION 1.41421356
+// Random games that go on this long are scored as draws, standing in for the
+// repetitions the playouts don't track.
+#define MCTS_MAX_PLAYOUT_PLIES 128
+#define MCTS_MAX_TREE_DEPTH 128
+#define MCTS_TIME_CHECK_INTERVAL 256
+// Score of a won simulation; draws and net evaluations score in between.
+#define MCTS_SCORE_SCALE 1024
+// Leaves a thread collects before running the net on all of them at once.
+#define MCTS_NET_BATCH_SIZE 16
+// Spread the seeds of successive searches and of the threads of one search.
+#define MCTS_SEED_SEARCH_STRIDE 1000003
+#define MCTS_SEED_THREAD_STRIDE 7919
+
+enum MonteCarloParallelism {
+  // all threads grow one shared tree
+  TREE_PARALLEL = 0,
+  // every thread grows a tree of its own and the root visits are summed
+  ROOT_PARALLEL = 1
+};
+
+struct MonteCarloOptions {
+  MonteCarloOptions() : parallelism(MonteCarloParallelism::TREE_PARALLEL), isSeeded(false), seed(0), playouts(0), useNet(false), rolloutPlies(0) {}
+  MonteCarloParallelism parallelism;
+  // With a seed and a playout count in place of the time budget, searches on
+  // one thread or with root parallelism play the same games on every run.
+  bool isSeeded;
+  uint32_t seed;
+  // per thread; 0 searches for the time budget instead
+  long long playouts;
+  // On the small board, score leaves with the net after `rolloutPlies`
+  // random moves in place of random games to the end.
+  bool useNet;
+  int rolloutPlies;
+};
+
+struct MonteCarloStats {
+  MonteCarloStats() : playouts(0), netEvaluations(0), seconds(0), nodes(0), reusedVisits(0), numThreads(1) {}
+  long long playouts;
+  long long netEvaluations;
+  double seconds;
+  size_t nodes;
+  long long reusedVisits;
+  int numThreads;
+};
+
+// UCT: the tree is grown one node per playout, choosing children by UCB1 and
+// finishing each simulation with a uniformly random game on a scratch state.
+// Nodes live in a fixed pool with each node's children side by side, so a
+// search allocates nothing. When the tree is full, playouts continue from its
+// leaves without growing it. A later search from a position up to two plies
+// below the last root keeps that subtree.
+//
+// Threads sharing the tree count a visit on the way down and add its score on
+// the way back, so a line another thread is still playing out looks lost
+// until then (virtual loss) and the threads spread over different lines. A
+// leaf is expanded by the first thread to claim it; the others play out from
+// it meanwhile.
+//
+// With the net, a simulation ends with one inference instead of a random
+// game. Each thread descends MCTS_NET_BATCH_SIZE times, virtual loss keeping
+// the paths apart, and evaluates the leaves in a single batch before backing
+// any of them up.
+class MonteCarloTree {
+  public:
+    explicit MonteCarloTree(const size_t maxNodes = MCTS_MAX_NODES) : m_nodes(maxNodes), m_spare(maxNodes), m_size(0), m_numSearches(0), m_numRootMoves(0) {
+    }
+
+    // Searches `root` for `seconds`, or for options.playouts playouts a
+    // thread, and returns the most visited move.
+    Move search(const State& root, const double seconds, const int numThreads, const MonteCarloOptions& options, MonteCarloStats& stats) {
+      Stopwatch stopwatch;
+      const bool isRootParallel = options.parallelism == MonteCarloParallelism::ROOT_PARALLEL;
+      const uint32_t seed = options.isSeeded ? options.seed + MCTS_SEED_SEARCH_STRIDE * m_numSearches++ : random_device()();
+      stats = MonteCarloStats();
+      stats.numThreads = numThreads;
+      prepare(root);
+      stats.reusedVisits = m_nodes[0].visits;
+
+      while (isRootParallel && static_cast<int>(m_rootTrees.size()) < numThreads - 1) {
+        m_rootTrees.push_back(make_shared<MonteCarloTree>(m_nodes.size()));
+      }
+      vector<MonteCarloStats> threadStats(numThreads);
+      vector<thread> threads;
+      for (int i = 1; i < numThreads; ++i) {
+        MonteCarloTree* tree = isRootParallel ? m_rootTrees[i-1].get() : this;
+        if (isRootParallel) {
+          tree->prepare(root);
+        }
+        threads.push_back(thread(&MonteCarloTree::run, tree, cref(root), seconds, cref(options),
+                                 seed + MCTS_SEED_THREAD_STRIDE * i, cref(stopwatch), ref(threadStats[i])));
+      }
+      run(root, seconds, options, seed, stopwatch, threadStats[0]);
+      for (auto& t : threads) {
+        t.join();
+      }
+
+      stats.seconds = stopwatch.elapsed();
+      stats.nodes = min(m_size.load(), m_nodes.size());
+      for (int i = 0; i < numThreads; ++i) {
+        stats.playouts += threadStats[i].playouts;
+        stats.netEvaluations += threadStats[i].netEvaluations;
+        if (isRootParallel && i > 0) {
+          stats.nodes += min(m_rootTrees[i-1]->m_size.load(), m_nodes.size());
+        }
+      }
+      collectRoot(isRootParallel ? numThreads - 1 : 0);
+      int best = -1;
+      for (int i = 0; i < m_numRootMoves; ++i) {
+        if (best < 0 || m_rootMoves[i].visits > m_rootMoves[best].visits) {
+          best = i;
+        }
+      }
+      return best < 0 ? Move() : Move::unpack(m_rootMoves[best].move);
+    }
+
+    // Visits and average score of each root move in the last search, summed
+    // over the trees of all threads.
+    void printRoot(ostream& out) const {
+      for (int i = 0; i < m_numRootMoves; ++i) {
+        const RootMove& m = m_rootMoves[i];
+        out << Move::unpack(m.move).toString() << ": " << m.visits << " visits, "
+            << (m.visits > 0 ? static_cast<double>(m.score) / MCTS_SCORE_SCALE / m.visits : 0) << " score" << endl;
+      }
+    }
+
+  private:
+    enum NodeState {
+      UNEXPANDED = 0,
+      EXPANDING = 1,
+      EXPANDED = 2
+    };
+
+    struct Node {
+      Node() : key(0), visits(0), score(0), firstChild(0), numChildren(0), move(NO_MOVE), state(NodeState::UNEXPANDED) {}
+      Key_t key;
+      atomic<uint32_t> visits;
+      // sum of the simulations' scores for the side that moved into the node
+      atomic<uint64_t> score;
+      // valid once state is EXPANDED
+      uint32_t firstChild;
+      uint8_t numChildren;
+      uint8_t move;
+      atomic<uint8_t> state;
+    };
+
+    struct RootMove {
+      uint8_t move;
+      long long visits;
+      long long score;
+    };
+
+    static void copyNode(const Node& from, Node& to) {
+      to.key = from.key;
+      to.visits.store(from.visits.load(memory_order_relaxed), memory_order_relaxed);
+      to.score.store(from.score.load(memory_order_relaxed), memory_order_relaxed);
+      to.firstChild = from.firstChild;
+      to.numChildren = from.numChildren;
+      to.move = from.move;
+      to.state.store(from.state.load(memory_order_relaxed), memory_order_relaxed);
+    }
+
+    // Makes `root` the root, keeping what is known about it, and expands it
+    // before any thread starts.
+    void prepare(const State& root) {
+      reuse(root.getZobristHash());
+      expand(0, root);
+    }
+
+    void run(const State& root, const double seconds, const MonteCarloOptions& options, const uint32_t seed, const Stopwatch& stopwatch, MonteCarloStats& stats) {
+      static const int PATH_SIZE = MCTS_MAX_TREE_DEPTH + 2;
+      mt19937 rng(seed);
+      const bool useNet = options.useNet && root.getWidth() == 5 && root.getHeight() == 4;
+      const int batchSize = useNet ? MCTS_NET_BATCH_SIZE : 1;
+      const int rolloutPlies = useNet ? options.rolloutPlies : MCTS_MAX_PLAYOUT_PLIES;
+      vector<uint32_t> paths(batchSize * PATH_SIZE);
+      vector<int> depths(batchSize);
+      vector<double> whiteScores(batchSize);
+      vector<int> pending(batchSize);
+      vector<fann_type> inputs(batchSize * NNET_NUM_INPUTS);
+      vector<fann_type> preds(batchSize);
+      State s = root;
+      long long n = 0;
+
+      for (long long nextCheck = MCTS_TIME_CHECK_INTERVAL;
+           options.playouts > 0 ? n < options.playouts : (n < nextCheck || stopwatch.elapsed() < seconds); ) {
+        if (n >= nextCheck) {
+          nextCheck = n + MCTS_TIME_CHECK_INTERVAL;
+        }
+        const int size = options.playouts > 0 ? min(static_cast<long long>(batchSize), options.playouts - n) : batchSize;
+        int numPending = 0;
+        for (int i = 0; i < size; ++i) {
+          s = root;
+          const bool isOpen = descend(s, &paths[i * PATH_SIZE], depths[i], rng);
+          Player winner = s.getWinner();
+          if (isOpen && !playout(s, rng, rolloutPlies, winner) && useNet) {
+            s.getNeuralNetInput(&inputs[numPending * NNET_NUM_INPUTS]);
+            pending[numPending++] = i;
+            continue;
+          }
+          whiteScores[i] = winner == Player::NONE ? 0.5 : (winner == Player::WHITE ? 1 : 0);
+        }
+        if (numPending > 0) {
+          getNetEvaluator().runBatch(inputs.data(), numPending, preds.data());
+          // the net's output is white's score, as in State::getPredictedGoodness
+          for (int j = 0; j < numPending; ++j) {
+            whiteScores[pending[j]] = min(max(static_cast<double>(preds[j]), 0.0), 1.0);
+          }
+          stats.netEvaluations += numPending;
+        }
+        for (int i = 0; i < size; ++i) {
+          backup(&paths[i * PATH_SIZE], depths[i], whiteScores[i], root.getCurrTurn());
+        }
+        n += size;
+      }
+      stats.playouts = n;
+    }
+
+    // Walks from the root to a leaf, counting a visit at every node on the
+    // way, and steps into a random child if the leaf gets expanded. Returns
+    // false if the game is decided there or the path is too long to go on.
+    bool descend(State& s, uint32_t* path, int& depth, mt19937& rng) {
+      Undo undo;
+      depth = 0;
+      uint32_t idx = 0;
+      path[depth++] = idx;
+      m_nodes[idx].visits.fetch_add(1, memory_order_relaxed);
+      while (depth <= MCTS_MAX_TREE_DEPTH && m_nodes[idx].state.load(memory_order_acquire) == NodeState::EXPANDED &&
+             m_nodes[idx].numChildren > 0) {
+        idx = selectChild(idx);
+        m_nodes[idx].visits.fetch_add(1, memory_order_relaxed);
+        s.makeMove(Move::unpack(m_nodes[idx].move), undo);
+        path[depth++] = idx;
+      }
+      if (s.getWinner() != Player::NONE || depth > MCTS_MAX_TREE_DEPTH) {
+        return false;
+      }
+      // expanded on its second visit, this one counted on the way down
+      if (m_nodes[idx].visits.load(memory_order_relaxed) > 1) {
+        expand(idx, s);
+      }
+      if (m_nodes[idx].state.load(memory_order_acquire) == NodeState::EXPANDED && m_nodes[idx].numChildren > 0) {
+        idx = m_nodes[idx].firstChild + uniform_int_distribution<int>(0, m_nodes[idx].numChildren - 1)(rng);
+        m_nodes[idx].visits.fetch_add(1, memory_order_relaxed);
+        s.makeMove(Move::unpack(m_nodes[idx].move), undo);
+        path[depth++] = idx;
+      }
+      return true;
+    }
+
+    // A node's score is from the point of view of the side that moved into it.
+    void backup(const uint32_t* path, const int depth, const double whiteScore, const Player rootTurn) {
+      for (int d = 0; d < depth; ++d) {
+        const Player mover = (d % 2 == 1) ? rootTurn : OTHER(rootTurn);
+        const double score = mover == Player::WHITE ? whiteScore : 1 - whiteScore;
+        m_nodes[path[d]].score.fetch_add(llround(score * MCTS_SCORE_SCALE), memory_order_relaxed);
+      }
+    }
+
+    uint32_t selectChild(const uint32_t idx) const {
+      const Node& node = m_nodes[idx];
+      const double logVisits = log(static_cast<double>(node.visits.load(memory_order_relaxed)));
+      uint32_t best = node.firstChild;
+      double bestScore = -1;
+      for (uint32_t c = node.firstChild; c < node.firstChild + node.numChildren; ++c) {
+        const Node& child = m_nodes[c];
+        const uint32_t visits = child.visits.load(memory_order_relaxed);
+        if (visits == 0) {
+          return c;
+        }
+        const double score = static_cast<double>(child.score.load(memory_order_relaxed)) / MCTS_SCORE_SCALE / visits +
+                             MCTS_EXPLORATION * sqrt(logVisits / visits);
+        if (score > bestScore) {
+          bestScore = score;
+          best = c;
+        }
+      }
+      return best;
+    }
+
+    void expand(const uint32_t idx, const State& s) {
+      Node& node = m_nodes[idx];
+      if (node.state.load(memory_order_relaxed) != NodeState::UNEXPANDED ||
+          m_size.load(memory_order_relaxed) + MAX_MOVES > m_nodes.size()) {
+        return;
+      }
+      uint8_t expected = NodeState::UNEXPANDED;
+      if (!node.state.compare_exchange_strong(expected, NodeState::EXPANDING, memory_order_acquire)) {
+        return;
+      }
+      const MoveList moves = s.getMoves(s.getCurrTurn());
+      const size_t first = m_size.fetch_add(moves.size(), memory_order_relaxed);
+      if (first + moves.size() > m_nodes.size()) {
+        node.state.store(NodeState::UNEXPANDED, memory_order_release);
+        return;
+      }
+      State child = s;
+      Undo undo;
+      for (size_t i = 0; i < moves.size(); ++i) {
+        child.makeMove(moves[i], undo);
+        Node& c = m_nodes[first + i];
+        copyNode(Node(), c);
+        c.key = child.getZobristHash();
+        c.move = moves[i].pack();
+        child.unmakeMove(undo);
+      }
+      node.firstChild = static_cast<uint32_t>(first);
+      node.numChildren = static_cast<uint8_t>(moves.size());
+      node.state.store(NodeState::EXPANDED, memory_order_release);
+    }
+
+    // Plays up to `maxPlies` random moves and returns whether someone won on
+    // the way, setting `winner`. A side without moves loses.
+    static bool playout(State& s, mt19937& rng, const int maxPlies, Player& winner) {
+      Undo undo;
+      for (int ply = 0; ; ++ply) {
+        winner = s.getWinner();
+        if (winner != Player::NONE) {
+          return true;
+        }
+        const MoveList moves = s.getMoves(s.getCurrTurn());
+        if (moves.size() == 0) {
+          winner = OTHER(s.getCurrTurn());
+          return true;
+        }
+        if (ply == maxPlies) {
+          return false;
+        }
+        s.makeMove(moves[uniform_int_distribution<int>(0, moves.size() - 1)(rng)], undo);
+      }
+    }
+
+    // Sums the root children of this tree and of the first `numRootTrees`
+    // root-parallel trees by move.
+    void collectRoot(const int numRootTrees) {
+      const Node& root = m_nodes[0];
+      m_numRootMoves = root.numChildren;
+      for (int i = 0; i < m_numRootMoves; ++i) {
+        const Node& child = m_nodes[root.firstChild + i];
+        m_rootMoves[i].move = child.move;
+        m_rootMoves[i].visits = child.visits;
+        m_rootMoves[i].score = child.score;
+      }
+      for (int t = 0; t < numRootTrees; ++t) {
+        const vector<Node>& nodes = m_rootTrees[t]->m_nodes;
+        for (uint32_t c = nodes[0].firstChild; c < nodes[0].firstChild + nodes[0].numChildren; ++c) {
+          for (int i = 0; i < m_numRootMoves; ++i) {
+            if (m_rootMoves[i].move == nodes[c].move) {
+              m_rootMoves[i].visits += nodes[c].visits;
+              m_rootMoves[i].score += nodes[c].score;
+            }
+          }
+        }
+      }
+    }
+
+    // Makes the node for `key` the root, if the last search's tree reaches it
+    // within two plies, by copying its subtree to the front of the spare pool.
+    void reuse(const Key_t key) {
+      uint32_t found = NO_NODE;
+      if (m_size > 0) {
+        const Node& root = m_nodes[0];
+        if (root.key == key) {
+          found = 0;
+        }
+        for (uint32_t c = root.firstChild; found == NO_NODE && c < root.firstChild + root.numChildren; ++c) {
+          const Node& child = m_nodes[c];
+          if (child.key == key) {
+            found = c;
+            break;
+          }
+          for (uint32_t g = child.firstChild; g < child.firstChild + child.numChildren; ++g) {
+            if (m_nodes[g].key == key) {
+              found = g;
+              break;
+            }
+          }
+        }
+      }
+      if (found == NO_NODE) {
+        copyNode(Node(), m_nodes[0]);
+        m_nodes[0].key = key;
+        m_size = 1;
+        return;
+      }
+      if (found == 0) {
+        return;
+      }
+      copyNode(m_nodes[found], m_spare[0]);
+      size_t size = 1;
+      for (size_t i = 0; i < size; ++i) {
+        Node& node = m_spare[i];
+        if (node.numChildren > 0) {
+          for (int c = 0; c < node.numChildren; ++c) {
+            copyNode(m_nodes[node.firstChild + c], m_spare[size + c]);
+          }
+          node.firstChild = static_cast<uint32_t>(size);
+          size += node.numChildren;
+        }
+      }
+      m_nodes.swap(m_spare);
+      m_size = size;
+    }
+
+    static const uint32_t NO_NODE = 0xFFFFFFFF;
+
+    vector<Node> m_nodes;
+    vector<Node> m_spare;
+    atomic<size_t> m_size;
+    uint32_t m_numSearches;
+    // the trees of threads 1.. under root parallelism
+    vector< shared_ptr<MonteCarloTree> > m_rootTrees;
+    RootMove m_rootMoves[MAX_MOVES];
+    int m_numRootMoves;
+};
+
+#endif
@@ -0,0 +1,794 @@
+#ifndef INCLUDED_NATIVENET_H
+#define INCLUDED_NATIVENET_H
+
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <random>
+#include <stdexcept>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "NeuralNet.h"
+
+using namespace std;
+
+// Rows are padded to whole 64-byte blocks so the kernels never need tails.
+#define NATIVE_NET_ALIGNMENT 64
+#define NATIVE_NET_LANES 16
+// Largest input value the quantized first layer has to represent (black = 2).
+#define NNET_MAX_INPUT 2
+// int32 lanes of the int16 dot product are folded into int64 this often; each
+// madd lane adds at most 2 * 32767 * 127, so 128 rounds cannot overflow.
+#define NATIVE_NET_DOT_FLUSH 128
+#define NATIVE_NET_ERROR_SAMPLES 4096
+// Rows runBatch() pushes through each weight row while it is in cache.
+#define NATIVE_NET_BATCH_ROWS 8
+
+template <typename T>
+class AlignedBuffer {
+  public:
+    AlignedBuffer() : m_data(NULL), m_size(0) {
+    }
+
+    explicit AlignedBuffer(const size_t size) : m_data(NULL), m_size(0) {
+      resize(size);
+    }
+
+    AlignedBuffer(AlignedBuffer&& other) : m_data(other.m_data), m_size(other.m_size) {
+      other.m_data = NULL;
+      other.m_size = 0;
+    }
+
+    AlignedBuffer& operator=(AlignedBuffer&& other) {
+      swap(m_data, other.m_data);
+      swap(m_size, other.m_size);
+      return *this;
+    }
+
+    ~AlignedBuffer() {
+      free(m_data);
+    }
+
+    // Contents are not preserved; the new buffer is zeroed.
+    void resize(const size_t size) {
+      free(m_data);
+      m_data = NULL;
+      m_size = size;
+      void* p = NULL;
+      if (posix_memalign(&p, NATIVE_NET_ALIGNMENT, max<size_t>(1, size) * sizeof(T)) != 0) {
+        throw bad_alloc();
+      }
+      m_data = static_cast<T*>(p);
+      fill(m_data, m_data + size, T());
+    }
+
+    size_t size() const {
+      return m_size;
+    }
+
+    T* data() {
+      return m_data;
+    }
+
+    const T* data() const {
+      return m_data;
+    }
+
+    T& operator[](const size_t i) {
+      return m_data[i];
+    }
+
+    const T& operator[](const size_t i) const {
+      return m_data[i];
+    }
+
+  private:
+    AlignedBuffer(const AlignedBuffer&);
+    AlignedBuffer& operator=(const AlignedBuffer&);
+
+    T* m_data;
+    size_t m_size;
+};
+
+// All kernels take aligned pointers and a length that is a multiple of
+// NATIVE_NET_LANES.
+struct NetKernels {
+  const char* name;
+  void (*axpy)(float* y, float a, const float* x, size_t n);
+  float (*dot)(const float* a, const float* b, size_t n);
+  // y = clamp((x + bias) * steepness, -limit, limit), i.e. FANN's LINEAR; y may be x
+  void (*activateLinear)(float* y, const float* x, const float* bias, float steepness, float limit, size_t n);
+  void (*axpyInt16)(int16_t* y, int16_t a, const int16_t* x, size_t n);
+  // b must stay within the int8 range
+  int64_t (*dotInt16)(const int16_t* a, const int16_t* b, size_t n);
+};
+
+static void axpyScalar(float* y, const float a, const float* x, const size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    y[i] += a * x[i];
+  }
+}
+
+static float dotScalar(const float* a, const float* b, const size_t n) {
+  float sum = 0;
+  for (size_t i = 0; i < n; ++i) {
+    sum += a[i] * b[i];
+  }
+  return sum;
+}
+
+static void activateLinearScalar(float* y, const float* x, const float* bias, const float steepness, const float limit, const size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    y[i] = max(-limit, min(limit, (x[i] + bias[i]) * steepness));
+  }
+}
+
+static void axpyInt16Scalar(int16_t* y, const int16_t a, const int16_t* x, const size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    y[i] = static_cast<int16_t>(y[i] + a * x[i]);
+  }
+}
+
+static int64_t dotInt16Scalar(const int16_t* a, const int16_t* b, const size_t n) {
+  int64_t sum = 0;
+  for (size_t i = 0; i < n; ++i) {
+    sum += a[i] * b[i];
+  }
+  return sum;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static void axpySse2(float* y, const float a, const float* x, const size_t n) {
+  const __m128 va = _mm_set1_ps(a);
+  for (size_t i = 0; i < n; i += 4) {
+    _mm_store_ps(y + i, _mm_add_ps(_mm_load_ps(y + i), _mm_mul_ps(va, _mm_load_ps(x + i))));
+  }
+}
+
+__attribute__((target("sse2")))
+static float dotSse2(const float* a, const float* b, const size_t n) {
+  __m128 acc0 = _mm_setzero_ps();
+  __m128 acc1 = _mm_setzero_ps();
+  for (size_t i = 0; i < n; i += 8) {
+    acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_load_ps(a + i), _mm_load_ps(b + i)));
+    acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_load_ps(a + i + 4), _mm_load_ps(b + i + 4)));
+  }
+  float lanes[4];
+  _mm_storeu_ps(lanes, _mm_add_ps(acc0, acc1));
+  return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+}
+
+__attribute__((target("sse2")))
+static void activateLinearSse2(float* y, const float* x, const float* bias, const float steepness, const float limit, const size_t n) {
+  const __m128 vs = _mm_set1_ps(steepness);
+  const __m128 hi = _mm_set1_ps(limit);
+  const __m128 lo = _mm_set1_ps(-limit);
+  for (size_t i = 0; i < n; i += 4) {
+    const __m128 v = _mm_mul_ps(_mm_add_ps(_mm_load_ps(x + i), _mm_load_ps(bias + i)), vs);
+    _mm_store_ps(y + i, _mm_min_ps(hi, _mm_max_ps(lo, v)));
+  }
+}
+
+__attribute__((target("sse2")))
+static void axpyInt16Sse2(int16_t* y, const int16_t a, const int16_t* x, const size_t n) {
+  const __m128i va = _mm_set1_epi16(a);
+  for (size_t i = 0; i < n; i += 8) {
+    __m128i* py = reinterpret_cast<__m128i*>(y + i);
+    const __m128i vx = _mm_load_si128(reinterpret_cast<const __m128i*>(x + i));
+    _mm_store_si128(py, _mm_add_epi16(_mm_load_si128(py), _mm_mullo_epi16(va, vx)));
+  }
+}
+
+__attribute__((target("sse2")))
+static int64_t dotInt16Sse2(const int16_t* a, const int16_t* b, const size_t n) {
+  int64_t sum = 0;
+  for (size_t i = 0; i < n; ) {
+    __m128i acc = _mm_setzero_si128();
+    const size_t end = min(n, i + 8 * NATIVE_NET_DOT_FLUSH);
+    for (; i < end; i += 8) {
+      const __m128i va = _mm_load_si128(reinterpret_cast<const __m128i*>(a + i));
+      const __m128i vb = _mm_load_si128(reinterpret_cast<const __m128i*>(b + i));
+      acc = _mm_add_epi32(acc, _mm_madd_epi16(va, vb));
+    }
+    int32_t lanes[4];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), acc);
+    sum += static_cast<int64_t>(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+  }
+  return sum;
+}
+
+__attribute__((target("avx2")))
+static void axpyAvx2(float* y, const float a, const float* x, const size_t n) {
+  const __m256 va = _mm256_set1_ps(a);
+  for (size_t i = 0; i < n; i += 8) {
+    _mm256_store_ps(y + i, _mm256_add_ps(_mm256_load_ps(y + i), _mm256_mul_ps(va, _mm256_load_ps(x + i))));
+  }
+}
+
+__attribute__((target("avx2")))
+static float dotAvx2(const float* a, const float* b, const size_t n) {
+  __m256 acc0 = _mm256_setzero_ps();
+  __m256 acc1 = _mm256_setzero_ps();
+  for (size_t i = 0; i < n; i += 16) {
+    acc0 = _mm256_add_ps(acc0, _mm256_mul_ps(_mm256_load_ps(a + i), _mm256_load_ps(b + i)));
+    acc1 = _mm256_add_ps(acc1, _mm256_mul_ps(_mm256_load_ps(a + i + 8), _mm256_load_ps(b + i + 8)));
+  }
+  float lanes[8];
+  _mm256_storeu_ps(lanes, _mm256_add_ps(acc0, acc1));
+  return ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) + ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+}
+
+__attribute__((target("avx2")))
+static void activateLinearAvx2(float* y, const float* x, const float* bias, const float steepness, const float limit, const size_t n) {
+  const __m256 vs = _mm256_set1_ps(steepness);
+  const __m256 hi = _mm256_set1_ps(limit);
+  const __m256 lo = _mm256_set1_ps(-limit);
+  for (size_t i = 0; i < n; i += 8) {
+    const __m256 v = _mm256_mul_ps(_mm256_add_ps(_mm256_load_ps(x + i), _mm256_load_ps(bias + i)), vs);
+    _mm256_store_ps(y + i, _mm256_min_ps(hi, _mm256_max_ps(lo, v)));
+  }
+}
+
+__attribute__((target("avx2")))
+static void axpyInt16Avx2(int16_t* y, const int16_t a, const int16_t* x, const size_t n) {
+  const __m256i va = _mm256_set1_epi16(a);
+  for (size_t i = 0; i < n; i += 16) {
+    __m256i* py = reinterpret_cast<__m256i*>(y + i);
+    const __m256i vx = _mm256_load_si256(reinterpret_cast<const __m256i*>(x + i));
+    _mm256_store_si256(py, _mm256_add_epi16(_mm256_load_si256(py), _mm256_mullo_epi16(va, vx)));
+  }
+}
+
+__attribute__((target("avx2")))
+static int64_t dotInt16Avx2(const int16_t* a, const int16_t* b, const size_t n) {
+  int64_t sum = 0;
+  for (size_t i = 0; i < n; ) {
+    __m256i acc = _mm256_setzero_si256();
+    const size_t end = min(n, i + 16 * NATIVE_NET_DOT_FLUSH);
+    for (; i < end; i += 16) {
+      const __m256i va = _mm256_load_si256(reinterpret_cast<const __m256i*>(a + i));
+      const __m256i vb = _mm256_load_si256(reinterpret_cast<const __m256i*>(b + i));
+      acc = _mm256_add_epi32(acc, _mm256_madd_epi16(va, vb));
+    }
+    int32_t lanes[8];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), acc);
+    for (int j = 0; j < 8; ++j) {
+      sum += lanes[j];
+    }
+  }
+  return sum;
+}
+#endif
+
+// Every kernel set this CPU can run, fastest first. The scalar set is always last.
+static vector<NetKernels> getSupportedNetKernels() {
+  vector<NetKernels> kernels;
+#if defined(__x86_64__) || defined(__i386__)
+  if (__builtin_cpu_supports("avx2")) {
+    const NetKernels avx2 = { "avx2", axpyAvx2, dotAvx2, activateLinearAvx2, axpyInt16Avx2, dotInt16Avx2 };
+    kernels.push_back(avx2);
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    const NetKernels sse2 = { "sse2", axpySse2, dotSse2, activateLinearSse2, axpyInt16Sse2, dotInt16Sse2 };
+    kernels.push_back(sse2);
+  }
+#endif
+  const NetKernels scalar = { "scalar", axpyScalar, dotScalar, activateLinearScalar, axpyInt16Scalar, dotInt16Scalar };
+  kernels.push_back(scalar);
+  return kernels;
+}
+
+enum NetPrecision {
+  FLOAT32 = 0,
+  INT16 = 1
+};
+
+// Built-in inference for the evaluation net, independent of FANN at run time.
+//
+// FLOAT32 runs any layered net in single precision. The input layer and any
+// layer that widens keep FANN's weights transposed to input-major rows, so a
+// board costs one AXPY per occupied cell; narrowing layers keep output-major
+// rows and cost one dot product per output.
+//
+// INT16 handles one LINEAR hidden layer on integer inputs in [0, NNET_MAX_INPUT].
+// First-layer weights are int16, scaled so that no hidden sum can overflow, and
+// the output layer uses int8 weights against the int16 hidden sums. The error
+// against FANN is measured with measureMaxError().
+class NativeNet {
+  public:
+    NativeNet(FANN::neural_net& net, const NetPrecision precision, const NetKernels& kernels = getSupportedNetKernels().front()) : m_precision(precision), m_kernels(kernels), m_maxWidth(0) {
+      const vector<NetLayer> layers = getNetLayers(net);
+      for (const auto& layer : layers) {
+        m_maxWidth = max(m_maxWidth, padded(max(layer.numIn, layer.numOut)));
+      }
+      if (precision == NetPrecision::INT16) {
+        initQuantized(layers);
+      } else {
+        for (size_t l = 0; l < layers.size(); ++l) {
+          // the board input is sparse, so the first layer always skips empty cells
+          m_layers.push_back(makeLayer(layers[l], l == 0 || layers[l].numIn < layers[l].numOut));
+        }
+      }
+      m_numInputs = layers.front().numIn;
+      m_numOutputs = layers.back().numOut;
+    }
+
+    unsigned int getNumInputs() const {
+      return m_numInputs;
+    }
+
+    unsigned int getNumOutputs() const {
+      return m_numOutputs;
+    }
+
+    string describe() const {
+      return string(m_precision == NetPrecision::INT16 ? "int16" : "float32") + "/" + m_kernels.name;
+    }
+
+    fann_type run(const fann_type* input) const {
+      fann_type output;
+      run(input, &output);
+      return output;
+    }
+
+    void run(const fann_type* input, fann_type* output) const {
+      if (m_precision == NetPrecision::INT16) {
+        runQuantized(input, output);
+      } else {
+        runFloat(input, output);
+      }
+    }
+
+    // First-layer sums of one position, kept so a move can update them with two
+    // weight rows instead of recomputing the layer.
+    struct Accumulator {
+      AlignedBuffer<float> sums;
+      AlignedBuffer<int16_t> quantized;
+    };
+
+    void initAccumulator(Accumulator& acc) const {
+      if (m_precision == NetPrecision::INT16) {
+        acc.quantized.resize(m_hiddenBias.size());
+      } else {
+        acc.sums.resize(padded(m_layers.front().numOut));
+      }
+    }
+
+    void refreshAccumulator(const fann_type* input, Accumulator& acc) const {
+      if (m_precision == NetPrecision::INT16) {
+        sumQuantized(input, acc.quantized.data());
+      } else {
+        float* in = getScratch().values[0].data();
+        fill(in, in + padded(m_numInputs), 0.0f);
+        copy(input, input + m_numInputs, in);
+        sumLayer(m_layers.front(), in, acc.sums.data());
+      }
+    }
+
+    void copyAccumulator(const Accumulator& from, Accumulator& to) const {
+      if (m_precision == NetPrecision::INT16) {
+        copy(from.quantized.data(), from.quantized.data() + from.quantized.size(), to.quantized.data());
+      } else {
+        copy(from.sums.data(), from.sums.data() + from.sums.size(), to.sums.data());
+      }
+    }
+
+    // Input `value` moved from input `from` to input `to`.
+    void updateAccumulator(Accumulator& acc, const int from, const int to, const fann_type value) const {
+      if (m_precision == NetPrecision::INT16) {
+        const size_t stride = m_hiddenBias.size();
+        const int16_t x = static_cast<int16_t>(lrint(value));
+        m_kernels.axpyInt16(acc.quantized.data(), x, m_hiddenWeights.data() + to * stride, stride);
+        m_kernels.axpyInt16(acc.quantized.data(), -x, m_hiddenWeights.data() + from * stride, stride);
+      } else {
+        const Layer& layer = m_layers.front();
+        const size_t stride = acc.sums.size();
+        m_kernels.axpy(acc.sums.data(), value, layer.weights.data() + to * stride, stride);
+        m_kernels.axpy(acc.sums.data(), -value, layer.weights.data() + from * stride, stride);
+      }
+    }
+
+    // Runs everything after the first layer's sums.
+    void run(const Accumulator& acc, fann_type* output) const {
+      if (m_precision == NetPrecision::INT16) {
+        runQuantizedTail(acc.quantized.data(), output);
+      } else {
+        runFloatTail(acc.sums.data(), output);
+      }
+    }
+
+    fann_type run(const Accumulator& acc) const {
+      fann_type output;
+      run(acc, &output);
+      return output;
+    }
+
+    // inputs is numRows x getNumInputs(), outputs is numRows x getNumOutputs().
+    // Gives the same outputs as run() on each row.
+    void runBatch(const fann_type* inputs, const size_t numRows, fann_type* outputs) const {
+      for (size_t r = 0; r < numRows; r += NATIVE_NET_BATCH_ROWS) {
+        const size_t n = min(static_cast<size_t>(NATIVE_NET_BATCH_ROWS), numRows - r);
+        if (m_precision == NetPrecision::INT16) {
+          runQuantizedBlock(inputs + r * m_numInputs, n, outputs + r * m_numOutputs);
+        } else {
+          runFloatBlock(inputs + r * m_numInputs, n, outputs + r * m_numOutputs);
+        }
+      }
+    }
+
+    // Largest absolute output difference from FANN over random inputs.
+    double measureMaxError(FANN::neural_net& net, const size_t numSamples) const {
+      mt19937 sampleRng(numSamples);
+      uniform_int_distribution<int> cell(0, NNET_MAX_INPUT);
+      vector<fann_type> input(m_numInputs);
+      vector<fann_type> output(m_numOutputs);
+      double maxError = 0;
+      for (size_t i = 0; i < numSamples; ++i) {
+        for (auto& x : input) {
+          x = cell(sampleRng);
+        }
+        run(input.data(), output.data());
+        const fann_type* expected = net.run(input.data());
+        for (unsigned int j = 0; j < m_numOutputs; ++j) {
+          maxError = max(maxError, fabs(static_cast<double>(output[j] - expected[j])));
+        }
+      }
+      return maxError;
+    }
+
+  private:
+    struct Layer {
+      unsigned int numIn;
+      unsigned int numOut;
+      bool isInputMajor;
+      // LINEAR with one steepness for the whole layer, so it can be vectorized
+      bool isUniformLinear;
+      AlignedBuffer<float> weights;
+      AlignedBuffer<float> bias;
+      vector<FANN::activation_function_enum> activations;
+      vector<fann_type> steepness;
+    };
+
+    struct Scratch {
+      AlignedBuffer<float> values[2];
+      AlignedBuffer<float> sums;
+      AlignedBuffer<int16_t> hidden;
+      AlignedBuffer<int16_t> clamped;
+      // NATIVE_NET_BATCH_ROWS rows of m_maxWidth each
+      AlignedBuffer<float> block[2];
+      AlignedBuffer<int16_t> blockHidden;
+    };
+
+    static size_t padded(const size_t n) {
+      return (n + NATIVE_NET_LANES - 1) / NATIVE_NET_LANES * NATIVE_NET_LANES;
+    }
+
+    static bool isUniformLinear(const NetLayer& layer) {
+      for (unsigned int j = 0; j < layer.numOut; ++j) {
+        if (layer.activations[j] != FANN::LINEAR || layer.steepness[j] != layer.steepness[0]) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    static Layer makeLayer(const NetLayer& src, const bool isInputMajor) {
+      Layer layer;
+      layer.numIn = src.numIn;
+      layer.numOut = src.numOut;
+      layer.isInputMajor = isInputMajor;
+      layer.isUniformLinear = isUniformLinear(src);
+      layer.activations = src.activations;
+      layer.steepness = src.steepness;
+      layer.bias.resize(padded(src.numOut));
+      for (unsigned int j = 0; j < src.numOut; ++j) {
+        layer.bias[j] = src.bias[j];
+      }
+      if (layer.isInputMajor) {
+        const size_t stride = padded(src.numOut);
+        layer.weights.resize(src.numIn * stride);
+        for (unsigned int i = 0; i < src.numIn; ++i) {
+          for (unsigned int j = 0; j < src.numOut; ++j) {
+            layer.weights[i * stride + j] = src.weights[i * src.numOut + j];
+          }
+        }
+      } else {
+        const size_t stride = padded(src.numIn);
+        layer.weights.resize(src.numOut * stride);
+        for (unsigned int j = 0; j < src.numOut; ++j) {
+          for (unsigned int i = 0; i < src.numIn; ++i) {
+            layer.weights[j * stride + i] = src.weights[i * src.numOut + j];
+          }
+        }
+      }
+      return layer;
+    }
+
+    void initQuantized(const vector<NetLayer>& layers) {
+      if (layers.size() != 2 || !isUniformLinear(layers[0])) {
+        throw runtime_error("Quantized net needs exactly one LINEAR hidden layer");
+      }
+      const NetLayer& hidden = layers[0];
+      const NetLayer& output = layers[1];
+      const size_t stride = padded(hidden.numOut);
+
+      // the largest |hidden sum| any input can produce must fit in int16
+      double maxSum = 0;
+      for (unsigned int j = 0; j < hidden.numOut; ++j) {
+        double sum = fabs(hidden.bias[j]);
+        for (unsigned int i = 0; i < hidden.numIn; ++i) {
+          sum += NNET_MAX_INPUT * fabs(hidden.weights[i * hidden.numOut + j]);
+        }
+        maxSum = max(maxSum, sum);
+      }
+      m_hiddenScale = maxSum > 0 ? numeric_limits<int16_t>::max() / maxSum : 1;
+      m_hiddenSteepness = hidden.steepness[0];
+      // FANN clamps the steepness-scaled sum to +-150/steepness
+      m_hiddenLimit = static_cast<int>(min<double>(numeric_limits<int16_t>::max(),
+                                                   floor(150 / (m_hiddenSteepness * m_hiddenSteepness) * m_hiddenScale)));
+
+      m_hiddenWeights.resize(hidden.numIn * stride);
+      m_hiddenBias.resize(stride);
+      for (unsigned int j = 0; j < hidden.numOut; ++j) {
+        m_hiddenBias[j] = static_cast<int16_t>(lrint(hidden.bias[j] * m_hiddenScale));
+        for (unsigned int i = 0; i < hidden.numIn; ++i) {
+          m_hiddenWeights[i * stride + j] = static_cast<int16_t>(lrint(hidden.weights[i * hidden.numOut + j] * m_hiddenScale));
+        }
+      }
+
+      // output rows get their own int8 scale
+      m_outputWeights.resize(output.numOut * stride);
+      for (unsigned int j = 0; j < output.numOut; ++j) {
+        double maxWeight = 0;
+        for (unsigned int i = 0; i < output.numIn; ++i) {
+          maxWeight = max(maxWeight, fabs(output.weights[i * output.numOut + j]));
+        }
+        const double scale = maxWeight > 0 ? numeric_limits<int8_t>::max() / maxWeight : 1;
+        for (unsigned int i = 0; i < output.numIn; ++i) {
+          m_outputWeights[j * stride + i] = static_cast<int16_t>(lrint(output.weights[i * output.numOut + j] * scale));
+        }
+        m_outputScale.push_back(m_hiddenSteepness / (m_hiddenScale * scale));
+        m_outputBias.push_back(output.bias[j]);
+        m_outputActivations.push_back(output.activations[j]);
+        m_outputSteepness.push_back(output.steepness[j]);
+      }
+    }
+
+    Scratch& getScratch() const {
+      static thread_local Scratch scratch;
+      AlignedBuffer<float>* floats[3] = { &scratch.values[0], &scratch.values[1], &scratch.sums };
+      for (auto values : floats) {
+        if (values->size() < m_maxWidth) {
+          values->resize(m_maxWidth);
+        }
+      }
+      AlignedBuffer<int16_t>* ints[2] = { &scratch.hidden, &scratch.clamped };
+      for (auto values : ints) {
+        if (values->size() < m_maxWidth) {
+          values->resize(m_maxWidth);
+        }
+      }
+      const size_t blockSize = NATIVE_NET_BATCH_ROWS * m_maxWidth;
+      for (auto& values : scratch.block) {
+        if (values.size() < blockSize) {
+          values.resize(blockSize);
+        }
+      }
+      if (scratch.blockHidden.size() < blockSize) {
+        scratch.blockHidden.resize(blockSize);
+      }
+      return scratch;
+    }
+
+    // Sums of `layer` over `in`, without the bias.
+    void sumLayer(const Layer& layer, const float* in, float* out) const {
+      const size_t outStride = padded(layer.numOut);
+      fill(out, out + outStride, 0.0f);
+      if (layer.isInputMajor) {
+        for (unsigned int i = 0; i < layer.numIn; ++i) {
+          if (in[i] != 0) {
+            m_kernels.axpy(out, in[i], layer.weights.data() + i * outStride, outStride);
+          }
+        }
+      } else {
+        const size_t inStride = padded(layer.numIn);
+        for (unsigned int j = 0; j < layer.numOut; ++j) {
+          out[j] = m_kernels.dot(in, layer.weights.data() + j * inStride, inStride);
+        }
+      }
+    }
+
+    // sumLayer() of n rows that lie `stride` apart. Each weight row is used
+    // for all of them before moving on to the next.
+    void sumLayerBlock(const Layer& layer, const float* in, float* out, const size_t n, const size_t stride) const {
+      const size_t outStride = padded(layer.numOut);
+      for (size_t r = 0; r < n; ++r) {
+        fill(out + r * stride, out + r * stride + outStride, 0.0f);
+      }
+      if (layer.isInputMajor) {
+        for (unsigned int i = 0; i < layer.numIn; ++i) {
+          const float* w = layer.weights.data() + i * outStride;
+          for (size_t r = 0; r < n; ++r) {
+            const float x = in[r * stride + i];
+            if (x != 0) {
+              m_kernels.axpy(out + r * stride, x, w, outStride);
+            }
+          }
+        }
+      } else {
+        const size_t inStride = padded(layer.numIn);
+        for (unsigned int j = 0; j < layer.numOut; ++j) {
+          const float* w = layer.weights.data() + j * inStride;
+          for (size_t r = 0; r < n; ++r) {
+            out[r * stride + j] = m_kernels.dot(in + r * stride, w, inStride);
+          }
+        }
+      }
+    }
+
+    void activateLayer(const Layer& layer, const float* sums, float* out) const {
+      const size_t outStride = padded(layer.numOut);
+      if (layer.isUniformLinear) {
+        const float steepness = layer.steepness[0];
+        m_kernels.activateLinear(out, sums, layer.bias.data(), steepness, 150 / steepness, outStride);
+      } else {
+        for (unsigned int j = 0; j < layer.numOut; ++j) {
+          out[j] = activate(layer.activations[j], layer.steepness[j], sums[j] + layer.bias[j]);
+        }
+        fill(out + layer.numOut, out + outStride, 0.0f);
+      }
+    }
+
+    void runFloat(const fann_type* input, fann_type* output) const {
+      Scratch& scratch = getScratch();
+      float* in = scratch.values[0].data();
+      fill(in, in + padded(m_numInputs), 0.0f);
+      copy(input, input + m_numInputs, in);
+      sumLayer(m_layers.front(), in, scratch.sums.data());
+      runFloatTail(scratch.sums.data(), output);
+    }
+
+    void runFloatTail(const float* sums, fann_type* output) const {
+      Scratch& scratch = getScratch();
+      float* in = scratch.values[0].data();
+      float* out = scratch.values[1].data();
+      activateLayer(m_layers.front(), sums, in);
+      for (size_t l = 1; l < m_layers.size(); ++l) {
+        sumLayer(m_layers[l], in, out);
+        activateLayer(m_layers[l], out, out);
+        swap(in, out);
+      }
+      copy(in, in + m_numOutputs, output);
+    }
+
+    void runFloatBlock(const fann_type* inputs, const size_t n, fann_type* outputs) const {
+      Scratch& scratch = getScratch();
+      const size_t stride = m_maxWidth;
+      float* in = scratch.block[0].data();
+      float* out = scratch.block[1].data();
+      for (size_t r = 0; r < n; ++r) {
+        fill(in + r * stride, in + r * stride + padded(m_numInputs), 0.0f);
+        copy(inputs + r * m_numInputs, inputs + (r + 1) * m_numInputs, in + r * stride);
+      }
+      for (const auto& layer : m_layers) {
+        sumLayerBlock(layer, in, out, n, stride);
+        for (size_t r = 0; r < n; ++r) {
+          activateLayer(layer, out + r * stride, out + r * stride);
+        }
+        swap(in, out);
+      }
+      for (size_t r = 0; r < n; ++r) {
+        copy(in + r * stride, in + r * stride + m_numOutputs, outputs + r * m_numOutputs);
+      }
+    }
+
+    void sumQuantized(const fann_type* input, int16_t* hidden) const {
+      const size_t stride = m_hiddenBias.size();
+      copy(m_hiddenBias.data(), m_hiddenBias.data() + stride, hidden);
+      for (unsigned int i = 0; i < m_numInputs; ++i) {
+        const int16_t x = static_cast<int16_t>(lrint(input[i]));
+        assert(0 <= x && x <= NNET_MAX_INPUT);
+        if (x != 0) {
+          m_kernels.axpyInt16(hidden, x, m_hiddenWeights.data() + i * stride, stride);
+        }
+      }
+    }
+
+    void runQuantized(const fann_type* input, fann_type* output) const {
+      int16_t* hidden = getScratch().hidden.data();
+      sumQuantized(input, hidden);
+      runQuantizedTail(hidden, output);
+    }
+
+    void runQuantizedBlock(const fann_type* inputs, const size_t n, fann_type* outputs) const {
+      const size_t stride = m_hiddenBias.size();
+      int16_t* hidden = getScratch().blockHidden.data();
+      for (size_t r = 0; r < n; ++r) {
+        copy(m_hiddenBias.data(), m_hiddenBias.data() + stride, hidden + r * stride);
+      }
+      for (unsigned int i = 0; i < m_numInputs; ++i) {
+        const int16_t* w = m_hiddenWeights.data() + i * stride;
+        for (size_t r = 0; r < n; ++r) {
+          const int16_t x = static_cast<int16_t>(lrint(inputs[r * m_numInputs + i]));
+          assert(0 <= x && x <= NNET_MAX_INPUT);
+          if (x != 0) {
+            m_kernels.axpyInt16(hidden + r * stride, x, w, stride);
+          }
+        }
+      }
+      for (size_t r = 0; r < n; ++r) {
+        runQuantizedTail(hidden + r * stride, outputs + r * m_numOutputs);
+      }
+    }
+
+    void runQuantizedTail(const int16_t* hidden, fann_type* output) const {
+      const size_t stride = m_hiddenBias.size();
+      if (m_hiddenLimit < numeric_limits<int16_t>::max()) {
+        int16_t* clamped = getScratch().clamped.data();
+        for (size_t j = 0; j < stride; ++j) {
+          clamped[j] = static_cast<int16_t>(max(-m_hiddenLimit, min(m_hiddenLimit, static_cast<int>(hidden[j]))));
+        }
+        hidden = clamped;
+      }
+      for (unsigned int j = 0; j < m_numOutputs; ++j) {
+        const int64_t sum = m_kernels.dotInt16(hidden, m_outputWeights.data() + j * stride, stride);
+        output[j] = activate(m_outputActivations[j], m_outputSteepness[j], sum * m_outputScale[j] + m_outputBias[j]);
+      }
+    }
+
+  private:
+    NetPrecision m_precision;
+    NetKernels m_kernels;
+    size_t m_maxWidth;
+    unsigned int m_numInputs;
+    unsigned int m_numOutputs;
+    vector<Layer> m_layers;
+
+    double m_hiddenScale;
+    fann_type m_hiddenSteepness;
+    int m_hiddenLimit;
+    AlignedBuffer<int16_t> m_hiddenWeights;
+    AlignedBuffer<int16_t> m_hiddenBias;
+    AlignedBuffer<int16_t> m_outputWeights;
+    vector<double> m_outputScale;
+    vector<fann_type> m_outputBias;
+    vector<FANN::activation_function_enum> m_outputActivations;
+    vector<fann_type> m_outputSteepness;
+};
+
+#ifdef NATIVE_NET_QUANTIZED
+#define NATIVE_NET_PRECISION NetPrecision::INT16
+#else
+#define NATIVE_NET_PRECISION NetPrecision::FLOAT32
+#endif
+
+// Its error against FANN is checked by checkNativeNet() (-E), not here.
+inline const NativeNet& getNativeNet() {
+  static const NativeNet net(getNeuralNet(), NATIVE_NET_PRECISION);
+  return net;
+}
+
+// What the search evaluates leaves with: one immutable set of weights shared
+// by all threads, each thread running it with its own thread_local scratch,
+// so concurrent evaluation takes no locks.
+#ifdef USE_NATIVE_NET
+typedef NativeNet NetEvaluator;
+
+static const NetEvaluator& getNetEvaluator() {
+  return getNativeNet();
+}
+#else
+typedef DenseNet NetEvaluator;
+
+static const NetEvaluator& getNetEvaluator() {
+  return getDenseNet();
+}
+#endif
+
+#endif
@@ -0,0 +1,206 @@
+#ifndef INCLUDED_NEURALNET_H
+#define INCLUDED_NEURALNET_H
+
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+#include "doublefann.h"
+#include "fann_cpp.h"
+
+using namespace std;
+
+// USE_NNUE evaluates the native net incrementally during search.
+#ifdef USE_NNUE
+#ifndef USE_NEURALNET
+#define USE_NEURALNET
+#endif
+#ifndef USE_NATIVE_NET
+#define USE_NATIVE_NET
+#endif
+#endif
+
+#define NNET_FILE "neuroconnect_5_4.net"
+#define NNET_NUM_INPUTS 20
+
+// Loaded once, even when several threads ask for it at the same time. FANN's
+// run() writes into buffers inside the network, so searches never call it:
+// they go through getNetEvaluator(), whose weights are copied out of this net.
+static FANN::neural_net& getNeuralNet() {
+  static once_flag isLoaded;
+  static FANN::neural_net net;
+  call_once(isLoaded, [] {
+    if (!net.create_from_file(NNET_FILE)) {
+      throw runtime_error("Unable to initialize neural net from " NNET_FILE);
+    }
+  });
+  return net;
+}
+
+// FANN's piecewise-linear sigmoid approximations, with the same breakpoints.
+static inline fann_type stepwiseSegment(const double v1, const double r1, const double v2, const double r2, const fann_type sum) {
+  return ((r2 - r1) * (sum - v1)) / (v2 - v1) + r1;
+}
+
+static inline fann_type stepwise(const double* v, const double* r, const fann_type lo, const fann_type hi, const fann_type sum) {
+  if (sum < v[4]) {
+    if (sum < v[2]) {
+      if (sum < v[1]) {
+        return sum < v[0] ? lo : stepwiseSegment(v[0], r[0], v[1], r[1], sum);
+      }
+      return stepwiseSegment(v[1], r[1], v[2], r[2], sum);
+    }
+    return sum < v[3] ? stepwiseSegment(v[2], r[2], v[3], r[3], sum) : stepwiseSegment(v[3], r[3], v[4], r[4], sum);
+  }
+  return sum < v[5] ? stepwiseSegment(v[4], r[4], v[5], r[5], sum) : hi;
+}
+
+// Same steepness scaling, clamping and activation as fann_run.
+static inline fann_type activate(const FANN::activation_function_enum fn, const fann_type steepness, fann_type sum) {
+  static const double SIGMOID_V[6] = { -2.64665246009826660156e+00, -1.47221946716308593750e+00, -5.49306154251098632812e-01,
+                                        5.49306154251098632812e-01, 1.47221946716308593750e+00, 2.64665246009826660156e+00 };
+  static const double SIGMOID_R[6] = { 4.99999988824129104614e-03, 5.00000007450580596924e-02, 2.50000000000000000000e-01,
+                                       7.50000000000000000000e-01, 9.49999988079071044922e-01, 9.95000004768371582031e-01 };
+  static const double SYMMETRIC_V[6] = { -2.64665293693542480469e+00, -1.47221934795379638672e+00, -5.49306154251098632812e-01,
+                                          5.49306154251098632812e-01, 1.47221934795379638672e+00, 2.64665293693542480469e+00 };
+  static const double SYMMETRIC_R[6] = { -9.90000009536743164062e-01, -8.99999976158142089844e-01, -5.00000000000000000000e-01,
+                                          5.00000000000000000000e-01, 8.99999976158142089844e-01, 9.90000009536743164062e-01 };
+  sum *= steepness;
+  const fann_type maxSum = 150 / steepness;
+  sum = max(-maxSum, min(maxSum, sum));
+  switch (fn) {
+    case FANN::LINEAR: return sum;
+    case FANN::SIGMOID: return 1 / (1 + exp(-2 * sum));
+    case FANN::SIGMOID_SYMMETRIC: return 2 / (1 + exp(-2 * sum)) - 1;
+    case FANN::SIGMOID_STEPWISE: return stepwise(SIGMOID_V, SIGMOID_R, 0, 1, sum);
+    case FANN::SIGMOID_SYMMETRIC_STEPWISE: return stepwise(SYMMETRIC_V, SYMMETRIC_R, -1, 1, sum);
+    default: throw runtime_error("Unsupported activation function in neural net");
+  }
+}
+
+// One fully connected layer of a FANN network. Weights are stored input-major,
+// one contiguous row of numOut weights per input neuron.
+struct NetLayer {
+  unsigned int numIn;
+  unsigned int numOut;
+  vector<fann_type> weights;
+  vector<fann_type> bias;
+  vector<FANN::activation_function_enum> activations;
+  vector<fann_type> steepness;
+};
+
+static vector<NetLayer> getNetLayers(FANN::neural_net& net) {
+  if (net.get_network_type() != FANN::LAYER) {
+    throw runtime_error("Only layered neural nets can be copied out of FANN");
+  }
+  const unsigned int numLayers = net.get_num_layers();
+  vector<unsigned int> sizes(numLayers);
+  vector<unsigned int> biases(numLayers);
+  net.get_layer_array(&sizes[0]);
+  net.get_bias_array(&biases[0]);
+
+  // absolute FANN neuron index of each layer's first neuron
+  vector<unsigned int> firstNeuron(numLayers + 1, 0);
+  for (unsigned int l = 0; l < numLayers; ++l) {
+    firstNeuron[l+1] = firstNeuron[l] + sizes[l] + biases[l];
+  }
+
+  vector<NetLayer> layers(numLayers - 1);
+  for (unsigned int l = 0; l + 1 < numLayers; ++l) {
+    NetLayer& layer = layers[l];
+    layer.numIn = sizes[l];
+    layer.numOut = sizes[l+1];
+    layer.weights.assign(layer.numIn * layer.numOut, 0);
+    layer.bias.assign(layer.numOut, 0);
+    for (unsigned int j = 0; j < layer.numOut; ++j) {
+      layer.activations.push_back(net.get_activation_function(l+1, j));
+      layer.steepness.push_back(net.get_activation_steepness(l+1, j));
+    }
+  }
+
+  vector<FANN::connection> connections(net.get_total_connections());
+  net.get_connection_array(&connections[0]);
+  for (const auto& c : connections) {
+    const unsigned int toLayer = upper_bound(firstNeuron.begin(), firstNeuron.end(), c.to_neuron) - firstNeuron.begin() - 1;
+    NetLayer& layer = layers[toLayer - 1];
+    const unsigned int from = c.from_neuron - firstNeuron[toLayer - 1];
+    const unsigned int to = c.to_neuron - firstNeuron[toLayer];
+    if (from == layer.numIn) {
+      layer.bias[to] = c.weight;
+    } else {
+      layer.weights[from * layer.numOut + to] = c.weight;
+    }
+  }
+  return layers;
+}
+
+// A FANN network copied into dense per-layer matrices so that many inputs can
+// go through it in one pass. With input-major weights each layer becomes a
+// sequence of row AXPYs over a block of inputs. The weights are never written
+// after construction and each thread runs with its own buffers, so one
+// instance can be shared by any number of threads.
+class DenseNet {
+  public:
+    explicit DenseNet(FANN::neural_net& net) : m_layers(getNetLayers(net)) {
+    }
+
+    unsigned int getNumInputs() const {
+      return m_layers.front().numIn;
+    }
+
+    unsigned int getNumOutputs() const {
+      return m_layers.back().numOut;
+    }
+
+    fann_type run(const fann_type* input) const {
+      fann_type output;
+      runBatch(input, 1, &output);
+      return output;
+    }
+
+    // inputs is numRows x getNumInputs(), outputs is numRows x getNumOutputs().
+    void runBatch(const fann_type* inputs, const size_t numRows, fann_type* outputs) const {
+      static thread_local vector<fann_type> in, out;
+      in.assign(inputs, inputs + numRows * getNumInputs());
+      for (const auto& layer : m_layers) {
+        out.assign(numRows * layer.numOut, 0);
+        for (size_t r0 = 0; r0 < numRows; r0 += BATCH_BLOCK_ROWS) {
+          const size_t r1 = min(numRows, r0 + BATCH_BLOCK_ROWS);
+          // each weight row is reused for the whole block while it is in cache
+          for (unsigned int i = 0; i < layer.numIn; ++i) {
+            const fann_type* w = &layer.weights[i * layer.numOut];
+            for (size_t r = r0; r < r1; ++r) {
+              const fann_type x = in[r * layer.numIn + i];
+              if (x == 0) continue;
+              fann_type* o = &out[r * layer.numOut];
+              for (unsigned int j = 0; j < layer.numOut; ++j) {
+                o[j] += x * w[j];
+              }
+            }
+          }
+        }
+        // bias last, as FANN orders it after the layer's inputs
+        for (size_t r = 0; r < numRows; ++r) {
+          for (unsigned int j = 0; j < layer.numOut; ++j) {
+            fann_type& v = out[r * layer.numOut + j];
+            v = activate(layer.activations[j], layer.steepness[j], v + layer.bias[j]);
+          }
+        }
+        in.swap(out);
+      }
+      copy(in.begin(), in.begin() + numRows * getNumOutputs(), outputs);
+    }
+
+  private:
+    static const size_t BATCH_BLOCK_ROWS = 8;
+
+    vector<NetLayer> m_layers;
+};
+
+static const DenseNet& getDenseNet() {
+  static const DenseNet net(getNeuralNet());
+  return net;
+}
+
+#endif
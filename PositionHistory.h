@@ -0,0 +1,148 @@
+#ifndef INCLUDED_POSITIONHISTORY_H
+#define INCLUDED_POSITIONHISTORY_H
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "State.h"
+
+using namespace std;
+
+#define MAX_HISTORY 4096
+#define REPETITION_TABLE_SIZE (2 * MAX_HISTORY)
+
+// Keys of the positions played so far followed by the current search path.
+// Room for MAX_HISTORY keys is reserved up front, so pushing and popping
+// during search doesn't allocate until a game gets longer than that; then the
+// stack and the table grow.
+//
+// Next to the stack, an open-addressed table counts how often each key occurs
+// at even and at odd stack indices, so repetition checks cost O(1) no matter
+// how long the game is. Keys include the side to move, so only positions with
+// the same side to move are ever compared.
+class PositionHistory {
+  public:
+    PositionHistory() : m_numSlotsUsed(0), m_slots(REPETITION_TABLE_SIZE, Slot()) {
+      m_keys.reserve(MAX_HISTORY);
+    }
+
+    void push(const Key_t key) {
+      if (2 * (m_numSlotsUsed + 1) > m_slots.size()) {
+        rehash(2 * m_slots.size());
+      }
+      m_slots[findOrInsert(key)].count[m_keys.size() % 2]++;
+      m_keys.push_back(key);
+    }
+
+    void pop() {
+      assert(!m_keys.empty());
+      const Key_t key = m_keys.back();
+      m_keys.pop_back();
+      const size_t i = find(key);
+      Slot& slot = m_slots[i];
+      slot.count[m_keys.size() % 2]--;
+      if (isEmpty(slot)) {
+        erase(i);
+      }
+    }
+
+    size_t size() const {
+      return m_keys.size();
+    }
+
+    bool contains(const Key_t key) const {
+      return find(key) != m_slots.size();
+    }
+
+    // Threefold repetition: three earlier occurrences at the same index parity.
+    bool isRepeated(const Key_t key) const {
+      const size_t i = find(key);
+      return i != m_slots.size() && (m_slots[i].count[0] >= 3 || m_slots[i].count[1] >= 3);
+    }
+
+  private:
+    struct Slot {
+      Slot() : key(0) {
+        count[0] = 0;
+        count[1] = 0;
+      }
+      Key_t key;
+      uint32_t count[2];
+    };
+
+    size_t home(const Key_t key) const {
+      return static_cast<size_t>(key) & (m_slots.size() - 1);
+    }
+
+    size_t next(const size_t i) const {
+      return (i + 1) & (m_slots.size() - 1);
+    }
+
+    static bool isEmpty(const Slot& slot) {
+      return slot.count[0] == 0 && slot.count[1] == 0;
+    }
+
+    size_t find(const Key_t key) const {
+      for (size_t i = home(key); !isEmpty(m_slots[i]); i = next(i)) {
+        if (m_slots[i].key == key) {
+          return i;
+        }
+      }
+      return m_slots.size();
+    }
+
+    size_t findOrInsert(const Key_t key) {
+      size_t i = home(key);
+      for (; !isEmpty(m_slots[i]); i = next(i)) {
+        if (m_slots[i].key == key) {
+          return i;
+        }
+      }
+      m_slots[i].key = key;
+      ++m_numSlotsUsed;
+      return i;
+    }
+
+    // Reinserts the counts into a table of `size` slots, a power of two.
+    void rehash(const size_t size) {
+      vector<Slot> old(size, Slot());
+      old.swap(m_slots);
+      for (const auto& slot : old) {
+        if (!isEmpty(slot)) {
+          size_t i = home(slot.key);
+          while (!isEmpty(m_slots[i])) {
+            i = next(i);
+          }
+          m_slots[i] = slot;
+        }
+      }
+    }
+
+    // Backward-shift deletion keeps probe chains intact without tombstones.
+    void erase(size_t i) {
+      size_t j = i;
+      while (true) {
+        j = next(j);
+        if (isEmpty(m_slots[j])) {
+          break;
+        }
+        const size_t k = home(m_slots[j].key);
+        const bool inChain = (i <= j) ? (i < k && k <= j) : (i < k || k <= j);
+        if (!inChain) {
+          m_slots[i] = m_slots[j];
+          i = j;
+        }
+      }
+      m_slots[i].count[0] = 0;
+      m_slots[i].count[1] = 0;
+      --m_numSlotsUsed;
+    }
+
+  private:
+    vector<Key_t> m_keys;
+    size_t m_numSlotsUsed;
+    vector<Slot> m_slots;
+};
+
+#endif
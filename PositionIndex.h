@@ -0,0 +1,157 @@
+#ifndef INCLUDED_POSITIONINDEX_H
+#define INCLUDED_POSITIONINDEX_H
+
+#include <cstddef>
+#include "Bitboard.h"
+#include "State.h"
+
+using namespace std;
+
+// Numbers every placement of NUM_PIECES_PER_SIDE pieces a side, with either
+// side to move, from 0 to size() - 1 without gaps: the combinatorial rank of
+// the white cells, then the rank of the black cells among the cells white
+// left free, then the side to move.
+class PositionIndex {
+  public:
+    PositionIndex(const int width, const int height)
+      : m_geometry(&getBoardGeometry(width, height)), m_width(width), m_numCells(width * height),
+        m_numWhiteSets(binomial(m_numCells, NUM_PIECES_PER_SIDE)),
+        m_numBlackSets(binomial(m_numCells - NUM_PIECES_PER_SIDE, NUM_PIECES_PER_SIDE)) {
+    }
+
+    size_t size() const {
+      return m_numWhiteSets * m_numBlackSets * 2;
+    }
+
+    size_t getNumWhiteSets() const {
+      return m_numWhiteSets;
+    }
+
+    // Positions sharing a white placement are numbered consecutively.
+    size_t getNumPerWhiteSet() const {
+      return m_numBlackSets * 2;
+    }
+
+    size_t getIndex(const Bitboard_t white, const Bitboard_t black, const Player turn) const {
+      int whiteCells[NUM_PIECES_PER_SIDE];
+      int blackCells[NUM_PIECES_PER_SIDE];
+      int w = 0, b = 0;
+      // squares and cells are both row-major, so cells come out sorted
+      for (Bitboard_t bb = white | black; bb; bb = clearLowest(bb)) {
+        const int sq = lowestSquare(bb);
+        if (white & squareBit(sq)) {
+          whiteCells[w++] = m_geometry->denseIndex[sq];
+        } else {
+          blackCells[b++] = m_geometry->denseIndex[sq] - w;
+        }
+      }
+      return (rankCells(whiteCells) * m_numBlackSets + rankCells(blackCells)) * 2 + turn;
+    }
+
+    // The lowest index among the position's images under the NUM_SYMMETRIES
+    // symmetries, all of which have the same game value.
+    size_t getCanonicalIndex(const Bitboard_t white, const Bitboard_t black, const Player turn) const {
+      size_t index = getIndex(white, black, turn);
+      for (int m = 0; m < NUM_MIRRORS; ++m) {
+        const Bitboard_t w = mirror(white, m);
+        const Bitboard_t b = mirror(black, m);
+        index = min(index, min(m == 0 ? index : getIndex(w, b, turn), getIndex(b, w, OTHER(turn))));
+      }
+      return index;
+    }
+
+    // Same as getCanonicalIndex(...) == index, but stops at the first image
+    // with a lower index.
+    bool isCanonical(const Bitboard_t white, const Bitboard_t black, const Player turn, const size_t index) const {
+      for (int m = 0; m < NUM_MIRRORS; ++m) {
+        const Bitboard_t w = mirror(white, m);
+        const Bitboard_t b = mirror(black, m);
+        if ((m != 0 && getIndex(w, b, turn) < index) || getIndex(b, w, OTHER(turn)) < index) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    Bitboard_t mirror(const Bitboard_t pieces, const int m) const {
+      if (m == 0) {
+        return pieces;
+      }
+      Bitboard_t res = 0;
+      for (Bitboard_t b = pieces; b; b = clearLowest(b)) {
+        res |= squareBit(m_geometry->mirrorSquare[m][lowestSquare(b)]);
+      }
+      return res;
+    }
+
+    void getPosition(const size_t index, Bitboard_t& white, Bitboard_t& black, Player& turn) const {
+      turn = static_cast<Player>(index % 2);
+      int whiteCells[NUM_PIECES_PER_SIDE];
+      int blackCells[NUM_PIECES_PER_SIDE];
+      unrankCells(index / 2 / m_numBlackSets, whiteCells);
+      unrankCells(index / 2 % m_numBlackSets, blackCells);
+      white = 0;
+      black = 0;
+      for (int i = 0; i < NUM_PIECES_PER_SIDE; ++i) {
+        white |= squareBit(cellSquare(whiteCells[i]));
+      }
+      int w = 0;
+      for (int cell = 0, free = 0, i = 0; cell < m_numCells && i < NUM_PIECES_PER_SIDE; ++cell) {
+        if (w < NUM_PIECES_PER_SIDE && whiteCells[w] == cell) {
+          ++w;
+          continue;
+        }
+        if (free++ == blackCells[i]) {
+          black |= squareBit(cellSquare(cell));
+          ++i;
+        }
+      }
+    }
+
+    int cellSquare(const int cell) const {
+      return toSquare(cell % m_width + 1, cell / m_width + 1);
+    }
+
+    static size_t binomial(const int n, const int k) {
+      static const struct Table {
+        Table() {
+          for (int n = 0; n <= MAX_CELLS; ++n) {
+            for (int k = 0; k <= NUM_PIECES_PER_SIDE; ++k) {
+              c[n][k] = (k == 0) ? 1 : (n == 0 ? 0 : c[n-1][k-1] + c[n-1][k]);
+            }
+          }
+        }
+        size_t c[MAX_CELLS + 1][NUM_PIECES_PER_SIDE + 1];
+      } table;
+      return n < 0 ? 0 : table.c[n][k];
+    }
+
+    // Sum of C(cell_i, i+1) over the cells in increasing order.
+    static size_t rankCells(const int* cells) {
+      size_t rank = 0;
+      for (int i = 0; i < NUM_PIECES_PER_SIDE; ++i) {
+        rank += binomial(cells[i], i + 1);
+      }
+      return rank;
+    }
+
+    static void unrankCells(size_t rank, int* cells) {
+      for (int i = NUM_PIECES_PER_SIDE - 1; i >= 0; --i) {
+        int c = i;
+        while (binomial(c + 1, i + 1) <= rank) {
+          ++c;
+        }
+        cells[i] = c;
+        rank -= binomial(c, i + 1);
+      }
+    }
+
+  private:
+    const BoardGeometry* m_geometry;
+    int m_width;
+    int m_numCells;
+    size_t m_numWhiteSets;
+    size_t m_numBlackSets;
+};
+
+#endif
@@ -4,31 +4,22 @@
 #include <algorithm>
 #include <bitset>
 #include <cassert>
+#include <chrono>
 #include <cstddef>
 #include <cstdlib>
 #include <ctime>
 #include <iostream>
+#include <limits>
+#include <memory>
 #include <unordered_map>
 #include <sstream>
 #include <vector>
-#include "doublefann.h"
-#include "fann_cpp.h"
+#include "Bitboard.h"
+#include "NativeNet.h"
+#include "NeuralNet.h"
 #include "Zobrist.h"
 
 using namespace std;
-#define NNET_FILE "neuroconnect_5_4.net"
-
-static FANN::neural_net& getNeuralNet() {
-  static bool isInitialized = false;
-  static FANN::neural_net net;
-  if (!isInitialized) {
-    if (!net.create_from_file(NNET_FILE)) {
-      throw "Unable to initialize neural net";
-    }
-    isInitialized = true;
-  }
-  return net;
-}
 
 enum Flag {
   LOWERBOUND = 0,
@@ -36,79 +27,81 @@ enum Flag {
   EXACT = 2
 };
 
+#define NO_MOVE 0xFF
+
 struct Data {
-  Data() : depth(0), bestValue(0) {}
+  Data() : depth(0), bestValue(0), bestMove(NO_MOVE) {}
   int depth;
   int bestValue;
   Flag flag;
+  uint8_t bestMove;
 };
 
 typedef bitset<85> Hash_t;
 typedef unordered_map<Hash_t, Data> StateMap_t;
+typedef uint64_t Key_t;
+
+// Decimal form of a Hash_t as used in state files. On the large board a hash
+// takes 85 bits, more than an unsigned long holds.
+inline string hashToString(const Hash_t& hash) {
+  static const Hash_t lowMask(~static_cast<uint64_t>(0));
+  unsigned __int128 h = (static_cast<unsigned __int128>((hash >> 64).to_ullong()) << 64) | (hash & lowMask).to_ullong();
+  char digits[40];
+  int n = 0;
+  do {
+    digits[n++] = '0' + static_cast<int>(h % 10);
+    h /= 10;
+  } while (h);
+  return string(reverse_iterator<char*>(digits + n), reverse_iterator<char*>(digits));
+}
+
+inline Hash_t hashFromString(const string& str) {
+  unsigned __int128 h = 0;
+  for (const char c : str) {
+    h = h * 10 + (c - '0');
+  }
+  return (Hash_t(static_cast<uint64_t>(h >> 64)) << 64) | Hash_t(static_cast<uint64_t>(h));
+}
 
 #define NUM_PIECES_PER_SIDE 4
+// The board mirrors, each also with the colours and the side to move swapped
+// (bit 2). All of them map a position to one with the same game value.
+#define NUM_SYMMETRIES (2 * NUM_MIRRORS)
 #define WHITE_CHAR '0'
 #define BLACK_CHAR '1'
 #define OTHER(player) ((player) == Player::WHITE ? Player::BLACK : Player::WHITE)
 #define toInt(c) (c - '0')
+// Net evaluations are clamped this far below INT_MAX, clear of mate scores.
+#define MAX_PREDICTED_GOODNESS (numeric_limits<int>::max() - 1024)
 
-class Timer {
+// Wall-clock time on a monotonic clock; clock() would measure CPU time.
+class Stopwatch {
   public:
-    Timer() {
-      m_start = clock();
+    Stopwatch() {
+      reset();
     }
-    ~Timer() {
-      double duration = (clock() - m_start) / (double)CLOCKS_PER_SEC;
-      cout << "Took: " << duration << "s" << endl;
+
+    void reset() {
+      m_start = chrono::steady_clock::now();
+    }
+
+    double elapsed() const {
+      return chrono::duration<double>(chrono::steady_clock::now() - m_start).count();
     }
 
   private:
-    clock_t m_start;
+    chrono::steady_clock::time_point m_start;
 };
 
-static vector< vector<int> > getCombinations(const int n, const int r) {
-  vector< vector<int> > res;
-
-  vector<bool> v(n);
-  fill(v.begin() + n - r, v.end(), true);
-
-  do {
-    vector<int> p;
-    p.reserve(r);
-    for (int i = 0; i < n; ++i) {
-      if (v[i]) {
-        p.push_back(i);
-      }
+class Timer {
+  public:
+    ~Timer() {
+      cout << "Took: " << m_stopwatch.elapsed() << "s" << endl;
     }
-    res.push_back(p);
-  } while (next_permutation(v.begin(), v.end()));
-
-  return res;
-}
-
-static const vector< vector<int> >& getCombinations_8_4() {
-  static vector< vector<int> > v;
-  if (v.empty()) {
-    v = getCombinations(8, 4);
-  }
-  return v;
-}
 
-static const vector< vector<int> >& getCombinations_4_3() {
-  static vector< vector<int> > v;
-  if (v.empty()) {
-    v = getCombinations(NUM_PIECES_PER_SIDE, 3);
-  }
-  return v;
-}
-
-static const vector< vector<int> >& getCombinations_4_2() {
-  static vector< vector<int> > v;
-  if (v.empty()) {
-    v = getCombinations(NUM_PIECES_PER_SIDE, 2);
-  }
-  return v;
-}
+  private:
+    Stopwatch m_stopwatch;
+};
 
 enum Direction {
   N = 0,
@@ -151,13 +144,33 @@ struct Piece {
   int y;
 };
 
+// A move packs its from-square into the upper six bits and its direction into
+// the lower two; NO_MOVE is the null move.
 struct Move {
-  Move() : x(0), y(0), dir(Direction::END) {}
-  Move(const int x, const int y, Direction dir) : x(x), y(y), dir(dir) {}
+  Move() : packed(NO_MOVE) {}
+  Move(const int x, const int y, Direction dir) : packed(static_cast<uint8_t>((toSquare(x, y) << 2) | dir)) {
+    assert(dir != Direction::END);
+  }
 
-  int x;
-  int y;
-  Direction dir;
+  int from() const {
+    return packed >> 2;
+  }
+
+  int x() const {
+    return squareX(from());
+  }
+
+  int y() const {
+    return squareY(from());
+  }
+
+  Direction dir() const {
+    return static_cast<Direction>(packed & 3);
+  }
+
+  bool isNull() const {
+    return packed == NO_MOVE;
+  }
 
   string dirStr(const Direction dir) const {
     if (Direction::N == dir) {
@@ -172,45 +185,113 @@ struct Move {
     return "";
   }
 
+  uint8_t pack() const {
+    return packed;
+  }
+
+  static Move unpack(const uint8_t m) {
+    Move move;
+    move.packed = m;
+    return move;
+  }
+
   string toString() const {
     stringstream ss;
-    if (x != 0 && y != 0 && dir != Direction::END) {
-      ss << x << y << dirStr(dir);
+    if (!isNull()) {
+      ss << x() << y() << dirStr(dir());
     }
     return ss.str();
   }
   bool operator==(const Move& rhs) const {
-    return x == rhs.x && y == rhs.y && dir == rhs.dir;
+    return packed == rhs.packed;
   }
   bool operator<(const Move& rhs) const {
-    if (x < rhs.x) {
-      return true;
-    } else if (x == rhs.x) {
-      if (y < rhs.y) {
-        return true;
-      } else {
-        return dir < rhs.dir;
-      }
-    } else {
-      return false;
-    }
+    return packed < rhs.packed;
   }
+
+  uint8_t packed;
+};
+
+#define MAX_MOVES (NUM_PIECES_PER_SIDE * 4)
+
+// Fixed-capacity move list that lives on the stack.
+class MoveList {
+  public:
+    MoveList() : m_size(0) {}
+
+    void push_back(const Move move) {
+      assert(m_size < MAX_MOVES);
+      m_moves[m_size++] = move;
+    }
+
+    size_t size() const {
+      return m_size;
+    }
+
+    bool empty() const {
+      return m_size == 0;
+    }
+
+    Move& operator[](const size_t i) {
+      return m_moves[i];
+    }
+
+    const Move& operator[](const size_t i) const {
+      return m_moves[i];
+    }
+
+    Move* begin() {
+      return m_moves;
+    }
+
+    Move* end() {
+      return m_moves + m_size;
+    }
+
+    const Move* begin() const {
+      return m_moves;
+    }
+
+    const Move* end() const {
+      return m_moves + m_size;
+    }
+
+  private:
+    Move m_moves[MAX_MOVES];
+    size_t m_size;
+};
+
+// Everything needed to take a move back.
+struct Undo {
+  uint8_t from;
+  uint8_t to;
+  uint8_t color;
 };
 
+static inline int stepSquare(const int sq, const Direction dir) {
+  static const int offsets[4] = { -BOARD_STRIDE, BOARD_STRIDE, 1, -1 };
+  return sq + offsets[static_cast<int>(dir)];
+}
+
+static inline Direction opposite(const Direction dir) {
+  return static_cast<Direction>(dir ^ 1);
+}
+
 class State {
   public:
-    State(const int width, const int height) : m_currTurn(Player::WHITE), m_width(width), m_height(height) {
+    State(const int width, const int height) : m_geometry(&getBoardGeometry(width, height)), m_currTurn(Player::WHITE), m_width(width), m_height(height) {
       const int offset = (7 == width && 6 == height ? 1 : 0);
 
-      getPieces(Player::WHITE).push_back(Piece(1+offset, 1+offset));
-      getPieces(Player::WHITE).push_back(Piece(5+offset, 2+offset));
-      getPieces(Player::WHITE).push_back(Piece(1+offset, 3+offset));
-      getPieces(Player::WHITE).push_back(Piece(5+offset, 4+offset));
+      m_pieces[Player::WHITE] = squareBit(toSquare(1+offset, 1+offset)) |
+                                squareBit(toSquare(5+offset, 2+offset)) |
+                                squareBit(toSquare(1+offset, 3+offset)) |
+                                squareBit(toSquare(5+offset, 4+offset));
 
-      getPieces(Player::BLACK).push_back(Piece(5+offset, 1+offset));
-      getPieces(Player::BLACK).push_back(Piece(1+offset, 2+offset));
-      getPieces(Player::BLACK).push_back(Piece(5+offset, 3+offset));
-      getPieces(Player::BLACK).push_back(Piece(1+offset, 4+offset));
+      m_pieces[Player::BLACK] = squareBit(toSquare(5+offset, 1+offset)) |
+                                squareBit(toSquare(1+offset, 2+offset)) |
+                                squareBit(toSquare(5+offset, 3+offset)) |
+                                squareBit(toSquare(1+offset, 4+offset));
+      computeZobristKeys();
     }
 
     Player getCurrTurn() const {
@@ -218,6 +299,11 @@ class State {
     }
 
     void setCurrTurn(const Player player) {
+      if (player != m_currTurn) {
+        for (int i = 0; i < NUM_SYMMETRIES; ++i) {
+          m_keys[i] ^= SIDE;
+        }
+      }
       m_currTurn = player;
     }
 
@@ -230,13 +316,14 @@ class State {
     }
 
     void setPieces(const vector<Piece>& whitePieces, const vector<Piece>& blackPieces) {
-      getPieces(Player::WHITE) = whitePieces;
-      getPieces(Player::BLACK) = blackPieces;
+      m_pieces[Player::WHITE] = toBitboard(whitePieces);
+      m_pieces[Player::BLACK] = toBitboard(blackPieces);
+      computeZobristKeys();
     }
 
     bool operator==(const State& rhs) const {
-      return isEqual(getPieces(Player::WHITE), rhs.getPieces(Player::WHITE)) &&
-             isEqual(getPieces(Player::BLACK), rhs.getPieces(Player::BLACK)) &&
+      return m_pieces[Player::WHITE] == rhs.m_pieces[Player::WHITE] &&
+             m_pieces[Player::BLACK] == rhs.m_pieces[Player::BLACK] &&
              m_currTurn == rhs.m_currTurn;
     }
 
@@ -244,22 +331,40 @@ class State {
       return !(this->operator==(rhs));
     }
 
-    vector<Piece>& getPieces(const Player player) {
+    Bitboard_t getBitboard(const Player player) const {
       return m_pieces[static_cast<int>(player)];
     }
 
-    const vector<Piece>& getPieces(const Player player) const {
-      return m_pieces[static_cast<int>(player)];
+    Bitboard_t getOccupied() const {
+      return m_pieces[Player::WHITE] | m_pieces[Player::BLACK];
     }
 
-    vector<Move> getMoves(const Player player) const {
-      vector<Move> v;
-      v.reserve(8);
-      for (const auto& piece : getPieces(player)) {
-        for (int dir = Direction::N; dir != Direction::END; ++dir) {
-          if (isValidMove(piece, static_cast<Direction>(dir))) {
-            v.push_back(Move(piece.x, piece.y, static_cast<Direction>(dir)));
-          }
+    vector<Piece> getPieces(const Player player) const {
+      vector<Piece> v;
+      v.reserve(NUM_PIECES_PER_SIDE);
+      for (Bitboard_t b = getBitboard(player); b; b = clearLowest(b)) {
+        const int sq = lowestSquare(b);
+        v.push_back(Piece(squareX(sq), squareY(sq)));
+      }
+      return v;
+    }
+
+    // Shifts the player's pieces one square in each direction and keeps the
+    // ones that land on empty board squares.
+    MoveList getMoves(const Player player) const {
+      MoveList v;
+      const Bitboard_t pieces = getBitboard(player);
+      const Bitboard_t empty = m_geometry->squares & ~getOccupied();
+      const Bitboard_t targets[4] = {
+        (pieces >> BOARD_STRIDE) & empty,
+        (pieces << BOARD_STRIDE) & empty,
+        (pieces << 1) & empty,
+        (pieces >> 1) & empty
+      };
+      for (int dir = Direction::N; dir != Direction::END; ++dir) {
+        for (Bitboard_t b = targets[dir]; b; b = clearLowest(b)) {
+          const int from = stepSquare(lowestSquare(b), opposite(static_cast<Direction>(dir)));
+          v.push_back(Move::unpack(static_cast<uint8_t>((from << 2) | dir)));
         }
       }
       return v;
@@ -267,45 +372,66 @@ class State {
 
     bool move(const int x, const int y, const Direction dir, bool skipVerification = false) {
       if (x < 1 || x > m_width || y < 1 || y > m_height || !hasPiece(x, y)) return false;
-      return movePiece(findPiece(x, y), dir, skipVerification);
+      return movePiece(Piece(x, y), dir, skipVerification);
     }
 
-    bool movePiece(Piece& piece, const Direction dir, bool skipVerification) {
+    bool movePiece(const Piece& piece, const Direction dir, bool skipVerification) {
       if (!skipVerification && !isValidMove(piece, dir)) return false;
-      if (Direction::N == dir) {
-        piece.y -= 1;
-      } else if (Direction::S == dir) {
-        piece.y += 1;
-      } else if (Direction::E == dir) {
-        piece.x += 1;
-      } else if (Direction::W == dir) {
-        piece.x -= 1;
-      }
-      m_currTurn = OTHER(m_currTurn);
+      Undo undo;
+      makeMove(Move(piece.x, piece.y, dir), undo);
       return true;
     }
 
+    // Applies a legal move and records what unmakeMove needs to revert it.
+    void makeMove(const Move& move, Undo& undo) {
+      const int from = move.from();
+      const int to = stepSquare(from, move.dir());
+      const int color = (m_pieces[Player::WHITE] & squareBit(from)) ? Player::WHITE : Player::BLACK;
+      undo.from = static_cast<uint8_t>(from);
+      undo.to = static_cast<uint8_t>(to);
+      undo.color = static_cast<uint8_t>(color);
+      m_pieces[color] ^= squareBit(from) | squareBit(to);
+      toggleKeys(color, from, to);
+      m_currTurn = OTHER(m_currTurn);
+    }
+
+    void unmakeMove(const Undo& undo) {
+      m_pieces[undo.color] ^= squareBit(undo.from) | squareBit(undo.to);
+      toggleKeys(undo.color, undo.from, undo.to);
+      m_currTurn = OTHER(m_currTurn);
+    }
+
     bool isValidMove(const Piece& piece, const Direction dir) const {
-      if (Direction::N == dir) {
-        if (piece.y == 1 || hasPiece(piece.x, piece.y-1)) return false;
-      } else if (Direction::S == dir) {
-        if (piece.y == m_height || hasPiece(piece.x, piece.y+1)) return false;
-      } else if (Direction::E == dir) {
-        if (piece.x == m_width || hasPiece(piece.x+1, piece.y)) return false;
-      } else if (Direction::W == dir) {
-        if (piece.x == 1 || hasPiece(piece.x-1, piece.y)) return false;
-      }
-      return true;
+      if (Direction::END == dir) return true;
+      const int to = stepSquare(toSquare(piece.x, piece.y), dir);
+      return to >= 0 && (m_geometry->squares & ~getOccupied() & squareBit(to)) != 0;
     }
 
     Player getWinner() const {
-      if (hasPlayerWon(getPieces(Player::WHITE))) return Player::WHITE;
-      else if (hasPlayerWon(getPieces(Player::BLACK))) return Player::BLACK;
+      if (hasLine(m_pieces[Player::WHITE])) return Player::WHITE;
+      else if (hasLine(m_pieces[Player::BLACK])) return Player::BLACK;
       else return Player::NONE;
     }
 
     bool hasPlayerWon(const Player player) const {
-      return hasPlayerWon(getPieces(player));
+      return hasLine(getBitboard(player));
+    }
+
+    // Whether the player can complete a line in one move: a line holding two
+    // of the player's pieces and an empty square next to a third piece from
+    // outside the line.
+    bool hasWinningMove(const Player player) const {
+      const Bitboard_t own = getBitboard(player);
+      const Bitboard_t reachable = orthogonalNeighbours(own) & m_geometry->squares & ~getOccupied();
+      const Bitboard_t* masks = m_geometry->winMasks;
+      for (int i = 0; i < m_geometry->numWinMasks; ++i) {
+        const Bitboard_t missing = masks[i] & ~own;
+        if ((missing & reachable) && popCount(missing) == 1 &&
+            (orthogonalNeighbours(missing) & own & ~masks[i])) {
+          return true;
+        }
+      }
+      return false;
     }
 
     void print() const {
@@ -313,15 +439,11 @@ class State {
       char grid[m_height][m_width];
       for (int i = 0; i < m_height; ++i) {
         for (int j = 0; j < m_width; ++j) {
-          grid[i][j] = '_';
+          const Bitboard_t bit = squareBit(toSquare(j+1, i+1));
+          grid[i][j] = (m_pieces[Player::WHITE] & bit) ? WHITE_CHAR :
+                       (m_pieces[Player::BLACK] & bit) ? BLACK_CHAR : '_';
         }
       }
-      for (const auto& piece : getPieces(Player::WHITE)) {
-        grid[piece.y-1][piece.x-1] = WHITE_CHAR;
-      }
-      for (const auto& piece : getPieces(Player::BLACK)) {
-        grid[piece.y-1][piece.x-1] = BLACK_CHAR;
-      }
       for (int i = 0; i < m_height; ++i) {
         for (int j = 0; j < m_width; ++j) {
           cout << (j == 0 ? "" : ",") << grid[i][j];
@@ -331,55 +453,55 @@ class State {
       cout << "==========" << endl;
     }
 
-    int getPredictedGoodness(const Player player) const {
-      fann_type input[20] = { 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0 };
-      int board[4][5] = {
-        { 0, 0, 0, 0, 0 },
-        { 0, 0, 0, 0, 0 },
-        { 0, 0, 0, 0, 0 },
-        { 0, 0, 0, 0, 0 }
-      };
-      for (const auto& p : getPieces(Player::WHITE)) {
-        const int x = p.x - 1;
-        const int y = p.y - 1;
-        board[y][x] = 1;
-      }
-
-      for (const auto& p : getPieces(Player::BLACK)) {
-        const int x = p.x - 1;
-        const int y = p.y - 1;
-        board[y][x] = 2;
-      }
-
-      for (int i = 0; i < m_height; ++i) {
-        for (int j = 0; j < m_width; ++j) {
-          const int index = i*m_width + j;
-          input[index] = board[i][j];
+    // Fills the NNET_NUM_INPUTS cells the net was trained on: 1 for white, 2 for black.
+    void getNeuralNetInput(fann_type* input) const {
+      fill(input, input + m_width * m_height, 0);
+      for (int color = 0; color < 2; ++color) {
+        for (Bitboard_t b = m_pieces[color]; b; b = clearLowest(b)) {
+          input[getCell(lowestSquare(b))] = getNeuralNetValue(static_cast<Player>(color));
         }
       }
+    }
 
-      fann_type* pred = getNeuralNet().run(input);
+    static fann_type getNeuralNetValue(const Player player) {
+      return player == Player::WHITE ? 1 : 2;
+    }
 
-      double pWin = pred[0];
-      int goodness = pWin*numeric_limits<int>::max();
+    // y*width + x index of a square, as used by the net input and Zobrist keys.
+    int getCell(const int sq) const {
+      return m_geometry->denseIndex[sq];
+    }
+
+    static int getPredictedGoodness(const fann_type pWin, const Player player) {
+      const double scaled = static_cast<double>(pWin) * numeric_limits<int>::max();
+      int goodness = static_cast<int>(max(-static_cast<double>(MAX_PREDICTED_GOODNESS), min(static_cast<double>(MAX_PREDICTED_GOODNESS), scaled)));
       if (player == Player::BLACK) {
         goodness *= -1; // all states were trained with white to move
       }
       return goodness;
     }
 
-    int getArea(const Piece& A, const Piece& B, const Piece& C) const {
-      return abs(A.x*(B.y-C.y) + B.x*(C.y-A.y) + C.x*(A.y-B.y));
+    int getPredictedGoodness(const Player player) const {
+      fann_type input[NNET_NUM_INPUTS];
+      getNeuralNetInput(input);
+      return getPredictedGoodness(getNetEvaluator().run(input), player);
     }
 
     int getBestArea(const Player player) const {
-      const auto& pieces = getPieces(player);
-      const auto& ps = getCombinations_4_3();
+      int cells[NUM_PIECES_PER_SIDE];
+      int n = 0;
+      for (Bitboard_t b = getBitboard(player); b; b = clearLowest(b)) {
+        assert(n < NUM_PIECES_PER_SIDE);
+        cells[n++] = getCell(lowestSquare(b));
+      }
 
       int best = numeric_limits<int>::max();
-      for (const auto& p : ps) {
-        const int area = getArea(pieces[p[0]], pieces[p[1]], pieces[p[2]]);
-        best = min(best, area);
+      for (int i = 0; i < n; ++i) {
+        for (int j = i + 1; j < n; ++j) {
+          for (int k = j + 1; k < n; ++k) {
+            best = min(best, static_cast<int>(m_geometry->triangleArea[cells[i]][cells[j]][cells[k]]));
+          }
+        }
       }
       return best;
     }
@@ -395,40 +517,47 @@ class State {
              100 * (bestArea);
     }
 
-    int64_t getZobristHash() const {
-      int64_t hash = 0;
-      for (const auto& p : getPieces(Player::WHITE)) {
-        const int x = p.x - 1;
-        const int y = p.y - 1;
-        const int index = y * m_width + x;
-        hash ^= PIECES[static_cast<int>(Player::WHITE)][index];
+    Key_t getZobristHash() const {
+      return m_keys[0];
+    }
+
+    // The lowest of the keys of the position's symmetric images, which is the
+    // same for all of them, and the symmetry that maps this position to the
+    // image it belongs to.
+    Key_t getCanonicalKey(int& symmetry) const {
+      symmetry = 0;
+      for (int i = 1; i < NUM_SYMMETRIES; ++i) {
+        if (m_keys[i] < m_keys[symmetry]) {
+          symmetry = i;
+        }
       }
-      for (const auto& p : getPieces(Player::BLACK)) {
-        const int x = p.x - 1;
-        const int y = p.y - 1;
-        const int index = y * m_width + x;
-        hash ^= PIECES[static_cast<int>(Player::BLACK)][index];
+      return m_keys[symmetry];
+    }
+
+    // Maps a packed move through a symmetry. Every symmetry is its own
+    // inverse, so this also maps a move back.
+    uint8_t transformMove(const uint8_t move, const int symmetry) const {
+      if (move == NO_MOVE) {
+        return move;
       }
-      if (m_currTurn == Player::BLACK) {
-        hash ^= SIDE;
+      const int mirror = symmetry % NUM_MIRRORS;
+      int dir = move & 3;
+      if ((mirror & 1) && (dir == Direction::E || dir == Direction::W)) {
+        dir ^= 1;
+      } else if ((mirror & 2) && (dir == Direction::N || dir == Direction::S)) {
+        dir ^= 1;
       }
-      return hash;
+      return static_cast<uint8_t>((m_geometry->mirrorSquare[mirror][move >> 2] << 2) | dir);
     }
 
     Hash_t getHash() const {
       const int boardSize = m_width * m_height;
       Hash_t hash;
-      for (const auto& p : getPieces(Player::WHITE)) {
-        const int x = p.x - 1;
-        const int y = p.y - 1;
-        const int index = y * m_width + x;
-        hash[index+boardSize] = 1;
+      for (Bitboard_t b = m_pieces[Player::WHITE]; b; b = clearLowest(b)) {
+        hash[m_geometry->denseIndex[lowestSquare(b)]+boardSize] = 1;
       }
-      for (const auto& p : getPieces(Player::BLACK)) {
-        const int x = p.x - 1;
-        const int y = p.y - 1;
-        const int index = y * m_width + x;
-        hash[index] = 1;
+      for (Bitboard_t b = m_pieces[Player::BLACK]; b; b = clearLowest(b)) {
+        hash[m_geometry->denseIndex[lowestSquare(b)]] = 1;
       }
       hash[2*boardSize] = m_currTurn == Player::BLACK ? 1 : 0;
       return hash;
@@ -436,146 +565,87 @@ class State {
 
     void fromHash(const Hash_t& hash) {
       const int boardSize = m_width * m_height;
-      auto& whitePieces = getPieces(Player::WHITE);
-      auto& blackPieces = getPieces(Player::BLACK);
-      whitePieces.clear();
-      blackPieces.clear();
+      m_pieces[Player::WHITE] = 0;
+      m_pieces[Player::BLACK] = 0;
       for (int i = 0; i < boardSize; ++i) {
+        const int sq = toSquare((i % m_width) + 1, (i / m_width) + 1);
         if (hash[i+boardSize]) {
-          const int x = (i % m_width) + 1;
-          const int y = (i / m_width) + 1;
-          whitePieces.push_back(Piece(x, y));
+          m_pieces[Player::WHITE] |= squareBit(sq);
         }
         if (hash[i]) {
-          const int x = (i % m_width) + 1;
-          const int y = (i / m_width) + 1;
-          blackPieces.push_back(Piece(x, y));
+          m_pieces[Player::BLACK] |= squareBit(sq);
         }
       }
       m_currTurn = hash[2*boardSize] ? Player::BLACK : Player::WHITE;
+      computeZobristKeys();
     }
 
   private:
+    // Pairs of own pieces touching each other; every pair is seen from both ends.
     int getNumRuns(const Player player) const {
-      const auto& ps = getCombinations_4_2();
-      const vector<Piece>& pieces = getPieces(player);
+      const Bitboard_t own = getBitboard(player);
       int numRuns = 0;
-      for (const auto& p : ps) {
-        const auto& A = pieces[p[0]];
-        const auto& B = pieces[p[1]];
-        if (isAdjacent(A.x, A.y, B.x, B.y) || isDiagonallyAdjacent(A.x, A.y, B.x, B.y)) {
-          numRuns++;
-        }
-      }
-      return numRuns;
-    }
-
-    bool hasPlayerWon(const vector<Piece>& pieces) const {
-      int board[6][7] = {
-        { 0, 0, 0, 0, 0, 0, 0 },
-        { 0, 0, 0, 0, 0, 0, 0 },
-        { 0, 0, 0, 0, 0, 0, 0 },
-        { 0, 0, 0, 0, 0, 0, 0 },
-        { 0, 0, 0, 0, 0, 0, 0 },
-        { 0, 0, 0, 0, 0, 0, 0 }
-      };
-      for (const auto& p : pieces) {
-        const int x = p.x - 1;
-        const int y = p.y - 1;
-        board[y][x] = 1;
-      }
-      for (int y = 1; y <= 4; ++y) {
-        for (int x = 1; x <= 5; ++x) {
-          if (!board[y][x]) continue;
-          if ((board[y+1][x+1] && board[y-1][x-1]) ||
-              (board[y+1][x-1] && board[y-1][x+1]) ||
-              (board[y][x-1] && board[y][x+1]) ||
-              (board[y-1][x] && board[y+1][x])) {
-            return true;
+      for (Bitboard_t b = own; b; b = clearLowest(b)) {
+        numRuns += popCount(m_geometry->neighbours[lowestSquare(b)] & own);
+      }
+      return numRuns / 2;
+    }
+
+    // Key i hashes the position as mirrored by i % NUM_MIRRORS, with colours
+    // and side to move swapped if i >= NUM_MIRRORS.
+    void computeZobristKeys() {
+      for (int i = 0; i < NUM_SYMMETRIES; ++i) {
+        const int* mirror = m_geometry->mirrorSquare[i % NUM_MIRRORS];
+        const int swap = i / NUM_MIRRORS;
+        Key_t hash = 0;
+        for (int color = 0; color < 2; ++color) {
+          for (Bitboard_t b = m_pieces[color]; b; b = clearLowest(b)) {
+            hash ^= PIECES[color ^ swap][m_geometry->denseIndex[mirror[lowestSquare(b)]]];
           }
         }
-      }
-      for (int y = 1; y <= 4; ++y) {
-        if ((board[y][0] && board[y-1][0] && board[y+1][0]) ||
-            (board[y][m_width-1] && board[y-1][m_width-1] && board[y+1][m_width-1])) {
-          return true;
-        }
-      }
-      for (int x = 1; x <= 5; ++x) {
-        if ((board[0][x] && board[0][x-1] && board[0][x+1]) ||
-            (board[m_height-1][x] && board[m_height-1][x-1] && board[m_height-1][x+1])) {
-          return true;
+        if ((m_currTurn == Player::BLACK) != (swap == 1)) {
+          hash ^= SIDE;
         }
+        m_keys[i] = hash;
       }
-      return false;
     }
 
-    bool isAdjacent(const int x1, const int y1, const int x2, const int y2) const {
-      const int dx = abs(x1 - x2);
-      const int dy = abs(y1 - y2);
-      return dx + dy == 1;
-    }
-
-    bool isDiagonallyAdjacent(const int x1, const int y1, const int x2, const int y2) const {
-      const int dx = abs(x1 - x2);
-      const int dy = abs(y1 - y2);
-      return dx == 1 && dy == 1;
+    void toggleKeys(const int color, const int from, const int to) {
+      for (int i = 0; i < NUM_SYMMETRIES; ++i) {
+        const int* mirror = m_geometry->mirrorSquare[i % NUM_MIRRORS];
+        const int c = color ^ (i / NUM_MIRRORS);
+        m_keys[i] ^= PIECES[c][m_geometry->denseIndex[mirror[from]]] ^
+                     PIECES[c][m_geometry->denseIndex[mirror[to]]] ^
+                     SIDE;
+      }
     }
 
-    bool hasPiece(const int x, const int y) const {
-      for (const auto& piece : getPieces(Player::WHITE)) {
-        if (piece.x == x && piece.y == y) {
-          return true;
-        }
-      }
-      for (const auto& piece : getPieces(Player::BLACK)) {
-        if (piece.x == x && piece.y == y) {
+    bool hasLine(const Bitboard_t pieces) const {
+      const Bitboard_t* masks = m_geometry->winMasks;
+      for (int i = 0; i < m_geometry->numWinMasks; ++i) {
+        if ((pieces & masks[i]) == masks[i]) {
           return true;
         }
       }
       return false;
     }
 
-    Piece& findPiece(const int x, const int y) {
-      for (auto& piece : getPieces(Player::WHITE)) {
-        if (piece.x == x && piece.y == y) {
-          return piece;
-        }
-      }
-      for (auto& piece : getPieces(Player::BLACK)) {
-        if (piece.x == x && piece.y == y) {
-          return piece;
-        }
-      }
-      assert(false);
-    }
-
-    const Piece& findPiece(const int x, const int y) const {
-      for (const auto& piece : getPieces(Player::WHITE)) {
-        if (piece.x == x && piece.y == y) {
-          return piece;
-        }
-      }
-      for (const auto& piece : getPieces(Player::BLACK)) {
-        if (piece.x == x && piece.y == y) {
-          return piece;
-        }
-      }
-      assert(false);
+    bool hasPiece(const int x, const int y) const {
+      return (getOccupied() & squareBit(toSquare(x, y))) != 0;
     }
 
-    inline bool isEqual(const vector<Piece>& v1, const vector<Piece>& v2) const {
-      if (v1.size() != v2.size()) return false;
-      for (const auto& piece : v1) {
-        if (find(v2.begin(), v2.end(), piece) == v2.end()) {
-          return false;
-        }
+    static Bitboard_t toBitboard(const vector<Piece>& pieces) {
+      Bitboard_t b = 0;
+      for (const auto& piece : pieces) {
+        b |= squareBit(toSquare(piece.x, piece.y));
       }
-      return true;
+      return b;
     }
 
   private:
-    vector<Piece> m_pieces[2];
+    const BoardGeometry* m_geometry;
+    Bitboard_t m_pieces[2];
+    Key_t m_keys[NUM_SYMMETRIES];
     Player m_currTurn;
     int m_width;
     int m_height;
@@ -0,0 +1,122 @@
+#ifndef INCLUDED_STATEENUMERATOR_H
+#define INCLUDED_STATEENUMERATOR_H
+
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "PositionIndex.h"
+#include "State.h"
+
+using namespace std;
+
+// Chunks a worker may finish ahead of the one being written out.
+#define STATE_ENUMERATOR_CHUNKS_AHEAD 4
+
+// Streams one position of every class of positions that are the same game up
+// to mirroring the board left-right and top-bottom, and swapping the colours
+// together with the side to move. The representative of a class is its member
+// with the lowest PositionIndex. The index space is split into chunks of one
+// white placement each, which worker threads canonicalize in parallel and
+// which are written in index order, so the output doesn't depend on the
+// number of threads and never has to be held in memory.
+class StateEnumerator {
+  public:
+    StateEnumerator(const int width, const int height)
+      : m_geometry(&getBoardGeometry(width, height)), m_index(width, height) {
+    }
+
+    size_t getNumPositions() const {
+      return m_index.size();
+    }
+
+    Hash_t getHash(const Bitboard_t white, const Bitboard_t black, const Player turn) const {
+      const int boardSize = m_geometry->width * m_geometry->height;
+      Hash_t hash;
+      for (Bitboard_t b = white; b; b = clearLowest(b)) {
+        hash[m_geometry->denseIndex[lowestSquare(b)]+boardSize] = 1;
+      }
+      for (Bitboard_t b = black; b; b = clearLowest(b)) {
+        hash[m_geometry->denseIndex[lowestSquare(b)]] = 1;
+      }
+      hash[2*boardSize] = turn == Player::BLACK ? 1 : 0;
+      return hash;
+    }
+
+    // Writes the hash of every representative, one per line, and returns how
+    // many there were.
+    size_t write(ostream& out, const int numThreads) const {
+      const size_t numChunks = m_index.getNumWhiteSets();
+      const size_t reportInterval = max(static_cast<size_t>(1), numChunks / 100);
+      mutex m;
+      condition_variable cv;
+      map<size_t, string> done;
+      size_t numWritten = 0;
+      size_t numStates = 0;
+      atomic<size_t> nextChunk(0);
+      Stopwatch stopwatch;
+
+      auto worker = [&]() {
+        string buf;
+        for (size_t chunk = nextChunk++; chunk < numChunks; chunk = nextChunk++) {
+          {
+            unique_lock<mutex> lock(m);
+            cv.wait(lock, [&] { return chunk < numWritten + STATE_ENUMERATOR_CHUNKS_AHEAD * numThreads; });
+          }
+          buf.clear();
+          const size_t end = (chunk + 1) * m_index.getNumPerWhiteSet();
+          for (size_t index = chunk * m_index.getNumPerWhiteSet(); index < end; ++index) {
+            Bitboard_t white, black;
+            Player turn;
+            m_index.getPosition(index, white, black, turn);
+            if (m_index.isCanonical(white, black, turn, index)) {
+              buf += hashToString(getHash(white, black, turn));
+              buf += '\n';
+            }
+          }
+          lock_guard<mutex> lock(m);
+          done[chunk].swap(buf);
+          cv.notify_all();
+        }
+      };
+      vector<thread> threads;
+      for (int i = 0; i < numThreads; ++i) {
+        threads.push_back(thread(worker));
+      }
+
+      for (size_t chunk = 0; chunk < numChunks; ++chunk) {
+        string buf;
+        {
+          unique_lock<mutex> lock(m);
+          cv.wait(lock, [&] { return done.count(chunk) > 0; });
+          buf.swap(done[chunk]);
+          done.erase(chunk);
+        }
+        out.write(buf.data(), buf.size());
+        numStates += count(buf.begin(), buf.end(), '\n');
+        {
+          lock_guard<mutex> lock(m);
+          ++numWritten;
+          cv.notify_all();
+        }
+        if ((chunk + 1) % reportInterval == 0) {
+          cout << "chunks: " << chunk + 1 << "/" << numChunks << ", states: " << numStates
+               << ", positions/s: " << (chunk + 1) * m_index.getNumPerWhiteSet() / max(stopwatch.elapsed(), 1e-9) << endl;
+        }
+      }
+      for (auto& t : threads) {
+        t.join();
+      }
+      return numStates;
+    }
+
+  private:
+    const BoardGeometry* m_geometry;
+    PositionIndex m_index;
+};
+
+#endif
@@ -0,0 +1,172 @@
+#ifndef INCLUDED_STATEMAP_H
+#define INCLUDED_STATEMAP_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "MappedFile.h"
+#include "State.h"
+
+using namespace std;
+
+#define STATEMAP_MAGIC "NCSM"
+#define STATEMAP_VERSION 1
+
+struct StateMapHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t width;
+  uint32_t height;
+  uint64_t numRecords;
+};
+
+// One saved search result. Hash_t is 85 bits wide: the low 64 go in hashLo,
+// the rest in hashHi. Records are sorted by (hashHi, hashLo).
+struct StateRecord {
+  uint64_t hashLo;
+  uint32_t hashHi;
+  int32_t bestValue;
+  int32_t depth;
+  uint8_t flag;
+  uint8_t bestMove;
+  uint8_t padding[2];
+
+  bool operator<(const StateRecord& rhs) const {
+    return hashHi != rhs.hashHi ? hashHi < rhs.hashHi : hashLo < rhs.hashLo;
+  }
+
+  bool operator==(const StateRecord& rhs) const {
+    return hashHi == rhs.hashHi && hashLo == rhs.hashLo;
+  }
+
+  Hash_t getHash() const {
+    return (Hash_t(hashHi) << 64) | Hash_t(hashLo);
+  }
+
+  Data getData() const {
+    Data d;
+    d.depth = depth;
+    d.bestValue = bestValue;
+    d.flag = static_cast<Flag>(flag);
+    d.bestMove = bestMove;
+    return d;
+  }
+};
+
+static StateRecord makeStateRecord(const Hash_t& hash, const Data& d) {
+  static const Hash_t lowMask(~static_cast<uint64_t>(0));
+  StateRecord r;
+  memset(&r, 0, sizeof(r));
+  r.hashLo = (hash & lowMask).to_ullong();
+  r.hashHi = static_cast<uint32_t>((hash >> 64).to_ullong());
+  r.bestValue = d.bestValue;
+  r.depth = d.depth;
+  r.flag = static_cast<uint8_t>(d.flag);
+  r.bestMove = d.bestMove;
+  return r;
+}
+
+// A binary statemap mapped read-only: a header followed by sorted
+// fixed-size records, probed in place by binary search. Nothing is parsed
+// or copied when it is opened.
+class StateMapFile {
+  public:
+    StateMapFile() : m_header(NULL), m_records(NULL) {
+    }
+
+    static bool isBinary(const string& fileName) {
+      ifstream in(fileName.c_str(), ios::binary);
+      char magic[4];
+      return in.read(magic, sizeof(magic)) && memcmp(magic, STATEMAP_MAGIC, sizeof(magic)) == 0;
+    }
+
+    bool open(const string& fileName) {
+      m_header = NULL;
+      m_records = NULL;
+      if (!m_file.open(fileName) || m_file.size() < sizeof(StateMapHeader)) {
+        return false;
+      }
+      const StateMapHeader* header = reinterpret_cast<const StateMapHeader*>(m_file.data());
+      if (memcmp(header->magic, STATEMAP_MAGIC, sizeof(header->magic)) != 0 || header->version != STATEMAP_VERSION ||
+          m_file.size() != sizeof(StateMapHeader) + header->numRecords * sizeof(StateRecord)) {
+        m_file.close();
+        return false;
+      }
+      m_header = header;
+      m_records = reinterpret_cast<const StateRecord*>(m_file.data() + sizeof(StateMapHeader));
+      return true;
+    }
+
+    size_t size() const {
+      return m_header ? m_header->numRecords : 0;
+    }
+
+    int getWidth() const {
+      return m_header ? m_header->width : 0;
+    }
+
+    int getHeight() const {
+      return m_header ? m_header->height : 0;
+    }
+
+    const StateRecord* begin() const {
+      return m_records;
+    }
+
+    const StateRecord* end() const {
+      return m_records + size();
+    }
+
+    bool find(const Hash_t& hash, Data& d) const {
+      Data empty;
+      empty.flag = Flag::EXACT;
+      const StateRecord key = makeStateRecord(hash, empty);
+      const StateRecord* it = lower_bound(begin(), end(), key);
+      if (it == end() || !(*it == key)) {
+        return false;
+      }
+      d = it->getData();
+      return true;
+    }
+
+    // Sorts the records and writes them out. Of records for the same state the
+    // one that comes last wins. The file is written under a temporary name and
+    // renamed, so mappings of the old file stay intact.
+    static bool write(const string& fileName, const int width, const int height, vector<StateRecord>& records) {
+      stable_sort(records.begin(), records.end());
+      size_t n = 0;
+      for (size_t i = 0; i < records.size(); ++i) {
+        if (i + 1 < records.size() && records[i] == records[i+1]) {
+          continue;
+        }
+        records[n++] = records[i];
+      }
+      records.resize(n);
+
+      StateMapHeader header;
+      memset(&header, 0, sizeof(header));
+      memcpy(header.magic, STATEMAP_MAGIC, sizeof(header.magic));
+      header.version = STATEMAP_VERSION;
+      header.width = width;
+      header.height = height;
+      header.numRecords = n;
+
+      const string tmpFileName = fileName + ".tmp";
+      ofstream out(tmpFileName.c_str(), ios::binary);
+      out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+      out.write(reinterpret_cast<const char*>(records.data()), n * sizeof(StateRecord));
+      out.close();
+      return out && rename(tmpFileName.c_str(), fileName.c_str()) == 0;
+    }
+
+  private:
+    MappedFile m_file;
+    const StateMapHeader* m_header;
+    const StateRecord* m_records;
+};
+
+#endif
@@ -0,0 +1,280 @@
+#ifndef INCLUDED_TABLEBASE_H
+#define INCLUDED_TABLEBASE_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include "MappedFile.h"
+#include "PositionIndex.h"
+#include "State.h"
+
+using namespace std;
+
+#define TABLEBASE_FILE "tablebase_5_4.bin"
+#define TABLEBASE_MAGIC "NCTB"
+#define TABLEBASE_VERSION 1
+#define TABLEBASE_WIDTH 5
+#define TABLEBASE_HEIGHT 4
+// C(20, 4) white placements times C(16, 4) black ones on the remaining cells
+#define TABLEBASE_WHITE_SETS 4845
+#define TABLEBASE_BLACK_SETS 1820
+#define TABLEBASE_SIZE (static_cast<size_t>(TABLEBASE_WHITE_SETS) * TABLEBASE_BLACK_SETS * 2)
+// Value byte: 0 is a draw, otherwise distance + 1 where the distance is the
+// number of plies to the end of the game with perfect play. Odd distances are
+// wins for the side to move, even ones losses.
+#define TABLEBASE_DRAW 0
+#define TABLEBASE_MAX_VALUE 255
+
+struct TablebaseHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t width;
+  uint32_t height;
+  uint64_t numPositions;
+};
+
+// Exact value of every 5x4 position with both sides to move, found by
+// retrograde analysis and stored by PositionIndex order.
+//
+// Solving starts from positions where the side to move has lost (the other
+// side has a line, or there is no legal move) and walks unmoves backwards one
+// distance per pass: a position with a lost successor is won, and a position
+// whose successors are all won is lost once the last of them is found.
+// Whatever is never reached is a draw.
+class Tablebase {
+  public:
+    Tablebase() : m_geometry(&getBoardGeometry(TABLEBASE_WIDTH, TABLEBASE_HEIGHT)), m_index(TABLEBASE_WIDTH, TABLEBASE_HEIGHT), m_values(NULL) {
+      assert(m_index.size() == TABLEBASE_SIZE);
+    }
+
+    static bool covers(const State& s) {
+      return s.getWidth() == TABLEBASE_WIDTH && s.getHeight() == TABLEBASE_HEIGHT &&
+             popCount(s.getBitboard(Player::WHITE)) == NUM_PIECES_PER_SIDE &&
+             popCount(s.getBitboard(Player::BLACK)) == NUM_PIECES_PER_SIDE;
+    }
+
+    bool isLoaded() const {
+      return m_values != NULL;
+    }
+
+    uint8_t probe(const State& s) const {
+      assert(covers(s) && isLoaded());
+      // only canonical entries are read, so probes touch an eighth of the file
+      return m_values[m_index.getCanonicalIndex(s.getBitboard(Player::WHITE), s.getBitboard(Player::BLACK), s.getCurrTurn())];
+    }
+
+    static bool isWin(const uint8_t value) {
+      return value != TABLEBASE_DRAW && (value - 1) % 2 == 1;
+    }
+
+    static bool isLoss(const uint8_t value) {
+      return value != TABLEBASE_DRAW && (value - 1) % 2 == 0;
+    }
+
+    static int getDistance(const uint8_t value) {
+      return value - 1;
+    }
+
+    void solve(const int numThreads) {
+      Stopwatch stopwatch;
+      unique_ptr< atomic<uint8_t>[] > values(new atomic<uint8_t>[TABLEBASE_SIZE]);
+      // successors not yet known to be won for the opponent
+      unique_ptr< atomic<uint8_t>[] > counts(new atomic<uint8_t>[TABLEBASE_SIZE]);
+
+      parallelFor(numThreads, [&](const size_t index) {
+        Position p = getPosition(index);
+        uint8_t value = TABLEBASE_DRAW;
+        uint8_t count = 0;
+        if (hasLine(p.pieces[OTHER(p.turn)])) {
+          value = 1;
+        } else if (!hasLine(p.pieces[p.turn])) {
+          count = static_cast<uint8_t>(countMoves(p));
+          if (count == 0) {
+            value = 1;
+          }
+        }
+        values[index].store(value, memory_order_relaxed);
+        counts[index].store(count, memory_order_relaxed);
+      });
+
+      for (int value = 1; ; ++value) {
+        if (value == TABLEBASE_MAX_VALUE) {
+          throw runtime_error("Tablebase distances don't fit in a byte");
+        }
+        const bool isLost = isLoss(static_cast<uint8_t>(value));
+        atomic<size_t> numFound(0);
+        atomic<size_t> numResolved(0);
+        parallelFor(numThreads, [&](const size_t index) {
+          if (values[index].load(memory_order_relaxed) != value) {
+            return;
+          }
+          ++numFound;
+          const Position s = getPosition(index);
+          forEachUnmove(s, [&](const Position& p) {
+            if (hasLine(p.pieces[Player::WHITE]) || hasLine(p.pieces[Player::BLACK])) {
+              return; // the game would have ended before reaching s
+            }
+            const size_t i = getIndex(p.pieces[Player::WHITE], p.pieces[Player::BLACK], p.turn);
+            if (values[i].load(memory_order_relaxed) != TABLEBASE_DRAW) {
+              return;
+            }
+            if (isLost) {
+              uint8_t expected = TABLEBASE_DRAW;
+              if (values[i].compare_exchange_strong(expected, static_cast<uint8_t>(value + 1), memory_order_relaxed)) {
+                ++numResolved;
+              }
+            } else if (counts[i].fetch_sub(1, memory_order_relaxed) == 1) {
+              values[i].store(static_cast<uint8_t>(value + 1), memory_order_relaxed);
+              ++numResolved;
+            }
+          });
+        });
+        if (numFound == 0) {
+          break;
+        }
+        cout << "distance " << value - 1 << ": " << numFound << " positions, "
+             << numResolved << " " << (isLost ? "wins" : "losses") << " at distance " << value
+             << ", elapsed: " << stopwatch.elapsed() << "s" << endl;
+      }
+
+      m_file.close();
+      m_solved.resize(TABLEBASE_SIZE);
+      size_t numWins = 0, numLosses = 0;
+      for (size_t i = 0; i < TABLEBASE_SIZE; ++i) {
+        m_solved[i] = values[i].load(memory_order_relaxed);
+        numWins += isWin(m_solved[i]);
+        numLosses += isLoss(m_solved[i]);
+      }
+      m_values = m_solved.data();
+      cout << "solved " << TABLEBASE_SIZE << " positions in " << stopwatch.elapsed() << "s: " << numWins << " wins, "
+           << numLosses << " losses, " << TABLEBASE_SIZE - numWins - numLosses << " draws" << endl;
+    }
+
+    bool save(const string& fileName) const {
+      ofstream out(fileName.c_str(), ios::binary);
+      const TablebaseHeader header = makeHeader();
+      out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+      out.write(reinterpret_cast<const char*>(m_values), TABLEBASE_SIZE);
+      return static_cast<bool>(out);
+    }
+
+    // Maps the file read-only; values are paged in as they are probed.
+    bool load(const string& fileName) {
+      m_values = NULL;
+      m_solved.clear();
+      const TablebaseHeader expected = makeHeader();
+      if (!m_file.open(fileName) || m_file.size() != sizeof(expected) + TABLEBASE_SIZE ||
+          memcmp(m_file.data(), &expected, sizeof(expected)) != 0) {
+        m_file.close();
+        return false;
+      }
+      m_values = reinterpret_cast<const uint8_t*>(m_file.data() + sizeof(expected));
+      return true;
+    }
+
+  private:
+    struct Position {
+      Bitboard_t pieces[2];
+      Player turn;
+    };
+
+    TablebaseHeader makeHeader() const {
+      TablebaseHeader header;
+      memset(&header, 0, sizeof(header));
+      memcpy(header.magic, TABLEBASE_MAGIC, sizeof(header.magic));
+      header.version = TABLEBASE_VERSION;
+      header.width = TABLEBASE_WIDTH;
+      header.height = TABLEBASE_HEIGHT;
+      header.numPositions = TABLEBASE_SIZE;
+      return header;
+    }
+
+    size_t getIndex(const Bitboard_t white, const Bitboard_t black, const Player turn) const {
+      return m_index.getIndex(white, black, turn);
+    }
+
+    Position getPosition(const size_t index) const {
+      Position p;
+      m_index.getPosition(index, p.pieces[Player::WHITE], p.pieces[Player::BLACK], p.turn);
+      return p;
+    }
+
+    bool hasLine(const Bitboard_t pieces) const {
+      for (int i = 0; i < m_geometry->numWinMasks; ++i) {
+        if ((pieces & m_geometry->winMasks[i]) == m_geometry->winMasks[i]) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    Bitboard_t getEmpty(const Position& p) const {
+      return m_geometry->squares & ~(p.pieces[Player::WHITE] | p.pieces[Player::BLACK]);
+    }
+
+    int countMoves(const Position& p) const {
+      const Bitboard_t empty = getEmpty(p);
+      int count = 0;
+      for (Bitboard_t b = p.pieces[p.turn]; b; b = clearLowest(b)) {
+        const int sq = lowestSquare(b);
+        for (int dir = 0; dir < 4; ++dir) {
+          const int to = stepSquare(sq, static_cast<Direction>(dir));
+          count += to >= 0 && (empty & squareBit(to)) != 0;
+        }
+      }
+      return count;
+    }
+
+    // Calls f with every position whose side to move could have reached s in
+    // one move.
+    template <typename F>
+    void forEachUnmove(const Position& s, F f) const {
+      const Player mover = OTHER(s.turn);
+      const Bitboard_t empty = getEmpty(s);
+      Position p;
+      p.turn = mover;
+      p.pieces[s.turn] = s.pieces[s.turn];
+      for (Bitboard_t b = s.pieces[mover]; b; b = clearLowest(b)) {
+        const int sq = lowestSquare(b);
+        for (int dir = 0; dir < 4; ++dir) {
+          const int from = stepSquare(sq, static_cast<Direction>(dir));
+          if (from >= 0 && (empty & squareBit(from)) != 0) {
+            p.pieces[mover] = s.pieces[mover] ^ squareBit(sq) ^ squareBit(from);
+            f(p);
+          }
+        }
+      }
+    }
+
+    template <typename F>
+    static void parallelFor(const int numThreads, F f) {
+      vector<thread> threads;
+      const size_t chunk = (TABLEBASE_SIZE + numThreads - 1) / numThreads;
+      for (int t = 0; t < numThreads; ++t) {
+        threads.push_back(thread([&f, t, chunk] {
+          const size_t end = min(TABLEBASE_SIZE, (t + 1) * chunk);
+          for (size_t i = t * chunk; i < end; ++i) {
+            f(i);
+          }
+        }));
+      }
+      for (auto& t : threads) {
+        t.join();
+      }
+    }
+
+  private:
+    const BoardGeometry* m_geometry;
+    PositionIndex m_index;
+    MappedFile m_file;
+    vector<uint8_t> m_solved;
+    const uint8_t* m_values;
+};
+
+#endif
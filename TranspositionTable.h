@@ -0,0 +1,136 @@
+#ifndef INCLUDED_TRANSPOSITIONTABLE_H
+#define INCLUDED_TRANSPOSITIONTABLE_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include "State.h"
+
+using namespace std;
+
+#define DEFAULT_TT_SIZE_MB 64
+#define TT_GENERATION_BITS 6
+
+// The entry's payload is packed into one word and stored next to key ^ data,
+// so a reader racing with a writer in another thread sees a key mismatch
+// instead of a torn entry. No locks are taken on probe or store.
+struct TTEntry {
+  atomic<uint64_t> check;
+  atomic<uint64_t> data;
+};
+
+// Slot 0 keeps the deepest recent result, slot 1 is always replaced.
+struct TTBucket {
+  TTEntry entries[2];
+};
+
+static_assert(sizeof(TTEntry) == 16, "TTEntry must stay packed to 16 bytes");
+static_assert(sizeof(TTBucket) == 32, "two buckets must share a cache line");
+
+// data layout: value:32 | depth:8 | genFlag:8 (generation << 2 | flag) | move:8
+#define TT_DEPTH(data) static_cast<int8_t>((data) >> 32)
+#define TT_GENFLAG(data) static_cast<uint8_t>((data) >> 40)
+#define TT_MOVE(data) static_cast<uint8_t>((data) >> 48)
+
+class TranspositionTable {
+  public:
+    explicit TranspositionTable(const size_t sizeMb) : m_buckets(NULL), m_numBuckets(1), m_generation(0) {
+      const size_t maxBuckets = max<size_t>(1, sizeMb) * 1024 * 1024 / sizeof(TTBucket);
+      while (m_numBuckets * 2 <= maxBuckets) {
+        m_numBuckets *= 2;
+      }
+      void* p = NULL;
+      if (posix_memalign(&p, 64, m_numBuckets * sizeof(TTBucket)) != 0) {
+        throw bad_alloc();
+      }
+      m_buckets = static_cast<TTBucket*>(p);
+      clear();
+    }
+
+    ~TranspositionTable() {
+      free(m_buckets);
+    }
+
+    void clear() {
+      for (size_t i = 0; i < m_numBuckets; ++i) {
+        for (int j = 0; j < 2; ++j) {
+          m_buckets[i].entries[j].check.store(0, memory_order_relaxed);
+          m_buckets[i].entries[j].data.store(0, memory_order_relaxed);
+        }
+      }
+    }
+
+    // Called once per root search so entries from earlier moves can be evicted.
+    void newSearch() {
+      m_generation = (m_generation + 1) & ((1 << TT_GENERATION_BITS) - 1);
+    }
+
+    bool probe(const Key_t key, Data& d) const {
+      const TTBucket& bucket = m_buckets[key & (m_numBuckets - 1)];
+      for (int i = 0; i < 2; ++i) {
+        const uint64_t data = bucket.entries[i].data.load(memory_order_relaxed);
+        const uint64_t check = bucket.entries[i].check.load(memory_order_relaxed);
+        if ((check ^ data) == key && TT_GENFLAG(data) != 0) {
+          d.depth = TT_DEPTH(data);
+          d.bestValue = static_cast<int32_t>(data & 0xFFFFFFFF);
+          d.flag = static_cast<Flag>((TT_GENFLAG(data) & 3) - 1);
+          d.bestMove = TT_MOVE(data);
+          return true;
+        }
+      }
+      return false;
+    }
+
+    void store(const Key_t key, const Data& d) {
+      TTBucket& bucket = m_buckets[key & (m_numBuckets - 1)];
+      const int8_t depth = static_cast<int8_t>(min(d.depth, 127));
+      // flag is stored off by one so that a zeroed entry is never valid
+      const uint8_t genFlag = static_cast<uint8_t>((m_generation << 2) | (static_cast<int>(d.flag) + 1));
+      const uint64_t data = static_cast<uint64_t>(static_cast<uint32_t>(d.bestValue)) |
+                            static_cast<uint64_t>(static_cast<uint8_t>(depth)) << 32 |
+                            static_cast<uint64_t>(genFlag) << 40 |
+                            static_cast<uint64_t>(d.bestMove) << 48;
+
+      TTEntry& deep = bucket.entries[0];
+      TTEntry& recent = bucket.entries[1];
+      const uint64_t deepData = deep.data.load(memory_order_relaxed);
+      const uint64_t deepKey = deep.check.load(memory_order_relaxed) ^ deepData;
+      const uint64_t recentData = recent.data.load(memory_order_relaxed);
+      const uint64_t recentKey = recent.check.load(memory_order_relaxed) ^ recentData;
+      if (recentKey == key) {
+        write(recent, key, data);
+      } else if (deepKey == key || TT_GENFLAG(deepData) == 0 || isStale(deepData) || depth >= TT_DEPTH(deepData)) {
+        if (deepKey != key && TT_GENFLAG(deepData) != 0) {
+          write(recent, deepKey, deepData);
+        }
+        write(deep, key, data);
+      } else {
+        write(recent, key, data);
+      }
+    }
+
+    size_t getNumEntries() const {
+      return 2 * m_numBuckets;
+    }
+
+  private:
+    TranspositionTable(const TranspositionTable&);
+    TranspositionTable& operator=(const TranspositionTable&);
+
+    static void write(TTEntry& e, const uint64_t key, const uint64_t data) {
+      e.check.store(key ^ data, memory_order_relaxed);
+      e.data.store(data, memory_order_relaxed);
+    }
+
+    bool isStale(const uint64_t data) const {
+      return (TT_GENFLAG(data) >> 2) != m_generation;
+    }
+
+  private:
+    TTBucket* m_buckets;
+    size_t m_numBuckets;
+    int m_generation;
+};
+
+#endif
@@ -3,33 +3,33 @@
 #include <iomanip>
 #include <limits>
 #include <memory>
+#include <mutex>
 #include <random>
 #include <sys/stat.h>
 #include <unistd.h>
-#include <unordered_set>
 #include "Game.h"
 #include "State.h"
+#include "StateEnumerator.h"
+#include "StateMap.h"
 #include "tcpconnector.h"
 
 using namespace std;
 
-static void dumpStateMap(const int width, const int height, const StateMap_t& stateMap, const string& fileName) {
-  ofstream out(fileName.c_str());
-  for (const auto& p : stateMap) {
-    out << p.first.to_ulong() << " " << p.second.depth << " " << p.second.bestValue
-        << " " << static_cast<int>(p.second.flag) << endl;
-  }
-  out.close();
+#define POPULATE_SHARD_SIZE 4096
+#define POPULATE_CHECKPOINT_MAGIC "NCCP"
+
+inline bool fileExists(const std::string& name) {
+  struct stat buffer;
+  return (stat(name.c_str(), &buffer) == 0);
 }
 
-static StateMap_t loadStateMap(const std::string& fileName) {
+static StateMap_t loadTextStateMap(const std::string& fileName) {
   cout << "Loading statemap: " << fileName << endl;
   StateMap_t stateMap;
   ifstream in(fileName);
   string line;
   while (getline(in, line)) {
     unsigned long h = 0;
-    int goodness = 0;
     int flag;
     Data d;
     stringstream ss(line);
@@ -46,15 +46,52 @@ static StateMap_t loadStateMap(const std::string& fileName) {
   return stateMap;
 }
 
-inline bool fileExists(const std::string& name) {
-  struct stat buffer;
-  return (stat(name.c_str(), &buffer) == 0);
+// Writes a statemap in the old text format (one "hash depth value flag" line
+// per state) to <fileName>.bin in the binary one. The text file is left as is.
+static void convertStateMap(const int width, const int height, const std::string& fileName) {
+  const string outFileName = fileName + ".bin";
+  if (StateMapFile::isBinary(fileName)) {
+    cerr << "Already a binary statemap: " << fileName << endl;
+    return;
+  }
+  const StateMap_t stateMap = loadTextStateMap(fileName);
+  vector<StateRecord> records;
+  records.reserve(stateMap.size());
+  for (const auto& p : stateMap) {
+    records.push_back(makeStateRecord(p.first, p.second));
+  }
+  if (!StateMapFile::write(outFileName, width, height, records)) {
+    cerr << "Unable to write statemap: " << outFileName << endl;
+    return;
+  }
+  cout << "Wrote statemap: " << outFileName << endl;
+}
+
+// Maps a binary statemap. A missing file leaves the map empty; a text one
+// has to be converted with -c first. Returns false if the file can't be used.
+static bool openStateMap(const std::string& fileName, StateMapFile& stateMap) {
+  if (!fileExists(fileName)) {
+    return true;
+  }
+  if (!StateMapFile::isBinary(fileName)) {
+    cerr << fileName << " is a text statemap. Convert it with -c " << fileName
+         << " and use " << fileName << ".bin" << endl;
+    return false;
+  }
+  Stopwatch stopwatch;
+  if (!stateMap.open(fileName)) {
+    cerr << "Unable to open statemap: " << fileName << endl;
+    return false;
+  }
+  cout << "Mapped statemap: " << fileName << ", " << stateMap.size() << " states in "
+       << stopwatch.elapsed() * 1000 << "ms" << endl;
+  return true;
 }
 
-static int countDraws(const StateMap_t& stateMap) {
+static int countDraws(const StateMapFile& stateMap) {
   int numStates = 0;
-  for (const auto& p : stateMap) {
-    if (abs(p.second.bestValue) > 100000) { // either a win or loss
+  for (const auto& r : stateMap) {
+    if (abs(r.bestValue) > 100000) { // either a win or loss
       continue;
     }
     numStates++;
@@ -62,109 +99,214 @@ static int countDraws(const StateMap_t& stateMap) {
   return numStates;
 }
 
-static void populateStates(const int width, const int height, const int maxDepth, const std::string& fileName) {
-  unsigned long h = 0;
-  int numStates = 0;
-  Game game(width, height, maxDepth);
-  StateMap_t savedStateMap = loadStateMap(fileName+"_statemap");
-  game.setStateMap(savedStateMap);
-  ifstream in(fileName.c_str());
-  while (in >> h) {
-    State s(width, height);
-    Hash_t hash(h);
-    s.fromHash(hash);
-
-    int numExpanded = 0;
-    game.setCurrState(s);
-    game.negamax(s, Player::WHITE, maxDepth, -numeric_limits<int>::max(), numeric_limits<int>::max(), numExpanded);
+struct CheckpointHeader {
+  char magic[4];
+  uint32_t shardSize;
+  uint64_t numStates;
+};
+
+struct ShardHeader {
+  uint64_t shard;
+  uint64_t numRecords;
+};
+
+// Reads back the shards an interrupted run of the same input finished and
+// opens the checkpoint for appending. A shard cut off mid-write is dropped.
+static void openCheckpoint(const string& fileName, const uint64_t numStates, vector< vector<StateRecord> >& shards, vector<bool>& isDone, ofstream& out) {
+  CheckpointHeader expected;
+  memset(&expected, 0, sizeof(expected));
+  memcpy(expected.magic, POPULATE_CHECKPOINT_MAGIC, sizeof(expected.magic));
+  expected.shardSize = POPULATE_SHARD_SIZE;
+  expected.numStates = numStates;
+
+  off_t validSize = 0;
+  ifstream in(fileName.c_str(), ios::binary);
+  CheckpointHeader header;
+  if (in.read(reinterpret_cast<char*>(&header), sizeof(header)) && memcmp(&header, &expected, sizeof(header)) == 0) {
+    validSize = sizeof(header);
+    ShardHeader shard;
+    while (in.read(reinterpret_cast<char*>(&shard), sizeof(shard)) && shard.shard < shards.size() &&
+           shard.numRecords <= POPULATE_SHARD_SIZE) {
+      vector<StateRecord> records(shard.numRecords);
+      if (!in.read(reinterpret_cast<char*>(records.data()), records.size() * sizeof(StateRecord))) {
+        break;
+      }
+      shards[shard.shard].swap(records);
+      isDone[shard.shard] = true;
+      validSize += sizeof(shard) + shard.numRecords * sizeof(StateRecord);
+    }
+  } else if (in.is_open()) {
+    cout << "Ignoring checkpoint of a different input: " << fileName << endl;
+  }
+  in.close();
 
-#ifndef NDEBUG
-    numStates++;
-    if (numStates % 1000 == 0) {
-      cout << numStates << endl;
+  if (validSize > 0) {
+    if (truncate(fileName.c_str(), validSize) != 0) {
+      throw runtime_error("Unable to truncate checkpoint " + fileName);
     }
-#endif
+    out.open(fileName.c_str(), ios::binary | ios::app);
+  } else {
+    out.open(fileName.c_str(), ios::binary | ios::trunc);
+    out.write(reinterpret_cast<const char*>(&expected), sizeof(expected));
+    out.flush();
   }
+}
 
-  const StateMap_t& stateMap = game.getStateMap();
-  cout << "After: " << countDraws(stateMap) << endl;
-  dumpStateMap(width, height, stateMap, fileName+"_statemap");
+static void appendCheckpoint(ofstream& out, const size_t shard, const vector<StateRecord>& records) {
+  ShardHeader header;
+  header.shard = shard;
+  header.numRecords = records.size();
+  out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  out.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(StateRecord));
+  out.flush();
 }
 
-static void generateStates(const int width, const int height) {
-  const int n = width * height;
-  const int r = 8;
-  vector<bool> v(n);
-  fill(v.begin() + n - r, v.end(), true);
-
-  unordered_set<Hash_t> states;
-  states.reserve(8817900);
-  do {
-    vector<Piece> pieces;
-    pieces.reserve(r);
-    for (int i = 0; i < n; ++i) {
-      if (v[i]) {
-        const int x = (i % width) + 1;
-        const int y = (i / width) + 1;
-        pieces.push_back(Piece(x, y));
-      }
-    }
+// Searches every state in the input with numThreads workers. The input is cut
+// into shards of POPULATE_SHARD_SIZE states, and each shard is searched by a
+// fresh Game whose TT only holds the saved results for the shard's own states,
+// so a shard's results don't depend on which thread ran it or what it ran
+// before. Each finished shard is appended to a checkpoint file, and a rerun
+// after a crash only searches the shards still missing. The results are
+// merged in shard order.
+static void populateStates(const int width, const int height, const int maxDepth, const size_t ttSizeMb, const int numThreads, const std::string& fileName) {
+  const string stateMapFileName = fileName + "_statemap";
+  const string checkpointFileName = fileName + "_checkpoint";
+  StateMapFile savedStateMap;
+  if (!openStateMap(stateMapFileName, savedStateMap)) {
+    return;
+  }
 
-    const vector< vector<int> >& ps = getCombinations_8_4();
-    for (const auto& p : ps) {
-      vector<Piece> whitePieces;
-      vector<Piece> blackPieces;
-      for (const auto& i : p) {
-        whitePieces.push_back(pieces[i]);
-      }
-      for (int i = 0; i < r; ++i) {
-        if (find(p.begin(), p.end(), i) == p.end()) {
-          blackPieces.push_back(pieces[i]);
+  vector<Hash_t> hashes;
+  string h;
+  ifstream in(fileName.c_str());
+  while (in >> h) {
+    hashes.push_back(hashFromString(h));
+  }
+  in.close();
+
+  const size_t numShards = (hashes.size() + POPULATE_SHARD_SIZE - 1) / POPULATE_SHARD_SIZE;
+  vector< vector<StateRecord> > shards(numShards);
+  vector<bool> isDone(numShards, false);
+  ofstream checkpoint;
+  openCheckpoint(checkpointFileName, hashes.size(), shards, isDone, checkpoint);
+  vector<size_t> pending;
+  for (size_t i = 0; i < numShards; ++i) {
+    if (!isDone[i]) {
+      pending.push_back(i);
+    }
+  }
+  cout << "states: " << hashes.size() << ", shards: " << numShards << ", resumed: " << numShards - pending.size() << endl;
+
+  atomic<size_t> nextShard(0);
+  mutex checkpointMutex;
+  size_t numShardsDone = numShards - pending.size();
+  size_t numStatesDone = 0;
+  Stopwatch stopwatch;
+  auto worker = [&]() {
+    vector<StateRecord> records;
+    for (size_t i = nextShard++; i < pending.size(); i = nextShard++) {
+      const size_t shard = pending[i];
+      const size_t begin = shard * POPULATE_SHARD_SIZE;
+      const size_t end = min(hashes.size(), begin + POPULATE_SHARD_SIZE);
+      Game game(width, height, maxDepth, ttSizeMb);
+      for (size_t j = begin; j < end; ++j) {
+        State s(width, height);
+        s.fromHash(hashes[j]);
+        Data d;
+        if (savedStateMap.find(hashes[j], d)) {
+          game.setSavedState(s, d);
         }
       }
 
-      State s(width, height);
-      s.setPieces(whitePieces, blackPieces);
+      records.clear();
+      for (size_t j = begin; j < end; ++j) {
+        State s(width, height);
+        s.fromHash(hashes[j]);
 
-      State s1(width, height);
-      s1.fromHash(s.getHash());
+        int numExpanded = 0;
+        game.setCurrState(s);
+        game.negamax(s, OTHER(s.getCurrTurn()), maxDepth, -numeric_limits<int>::max(), numeric_limits<int>::max(), numExpanded);
 
-      assert(s == s1);
-      states.insert(s.getHash());
+        Data d;
+        if (game.probe(s, d)) {
+          records.push_back(makeStateRecord(hashes[j], d));
+        }
+      }
+
+      lock_guard<mutex> lock(checkpointMutex);
+      appendCheckpoint(checkpoint, shard, records);
+      numStatesDone += end - begin;
+      shards[shard].swap(records);
+      cout << "shards: " << ++numShardsDone << "/" << numShards << ", states/s: "
+           << numStatesDone / max(stopwatch.elapsed(), 1e-9) << endl;
     }
-  } while (next_permutation(v.begin(), v.end()));
+  };
+  vector<thread> threads;
+  for (int i = 0; i < numThreads; ++i) {
+    threads.push_back(thread(worker));
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  checkpoint.close();
+
+  vector<StateRecord> records(savedStateMap.begin(), savedStateMap.end());
+  for (const auto& shard : shards) {
+    records.insert(records.end(), shard.begin(), shard.end());
+  }
+  if (!StateMapFile::write(stateMapFileName, width, height, records)) {
+    cerr << "Unable to write statemap: " << stateMapFileName << endl;
+    return;
+  }
+  remove(checkpointFileName.c_str());
+  StateMapFile stateMap;
+  stateMap.open(stateMapFileName);
+  cout << "After: " << countDraws(stateMap) << ", states/s: " << numStatesDone / max(stopwatch.elapsed(), 1e-9) << endl;
+}
+
+// Writes the hash of one position per symmetry class to states_<w>_<h>.txt.
+static void generateStates(const int width, const int height, const int numThreads) {
   stringstream ss;
   ss << "states_" << width << "_" << height << ".txt";
   ofstream out(ss.str());
-  for (const auto& s : states) {
-    out << s.to_ulong() << endl;
-  }
+  StateEnumerator enumerator(width, height);
+  Stopwatch stopwatch;
+  const size_t numStates = enumerator.write(out, numThreads);
   out.close();
+  cout << "positions: " << enumerator.getNumPositions() << ", states: " << numStates
+       << ", elapsed: " << stopwatch.elapsed() << "s" << endl;
 }
 
 void createTrainData(const int width, const int height, const std::string& fileName) {
+  StateMapFile savedStateMap;
+  if (!openStateMap(fileName, savedStateMap)) {
+    return;
+  }
   ofstream out("train.dat");
-  StateMap_t savedStateMap = loadStateMap(fileName);
   int numStates = 0;
-  for (const auto& d : savedStateMap) {
-    if (abs(d.second.bestValue) > 100000) {
+  for (const auto& r : savedStateMap) {
+    if (abs(r.bestValue) > 100000) {
       numStates++;
     }
   }
   out << numStates << " 20 1" << endl;
-  for (const auto& d : savedStateMap) {
-    if (abs(d.second.bestValue) <= 100000) continue;
+  for (const auto& r : savedStateMap) {
+    if (abs(r.bestValue) <= 100000) continue;
     int board[4][5] = { 0 };
     State s(width, height);
-    s.fromHash(d.first);
+    s.fromHash(r.getHash());
+    // values are from the point of view of the side that just moved, as
+    // negamax stores them; write that side's pieces as white's so every label
+    // is white's
+    const Player player = OTHER(s.getCurrTurn());
 
-    for (const auto& p : s.getPieces(Player::WHITE)) {
+    for (const auto& p : s.getPieces(player)) {
       const int x = p.x - 1;
       const int y = p.y - 1;
       board[y][x] = 1;
     }
 
-    for (const auto& p : s.getPieces(Player::BLACK)) {
+    for (const auto& p : s.getPieces(OTHER(player))) {
       const int x = p.x - 1;
       const int y = p.y - 1;
       board[y][x] = 2;
@@ -181,7 +323,7 @@ void createTrainData(const int width, const int height, const std::string& fileN
     }
     assert(numPieces == NUM_PIECES_PER_SIDE*2);
     out << endl;
-    out << (d.second.bestValue > 100000 ? "1 0 0" : (d.second.bestValue < -100000 ? "0 1 0" : "0 0 1")) << endl;
+    out << (r.bestValue > 100000 ? "1 0 0" : (r.bestValue < -100000 ? "0 1 0" : "0 0 1")) << endl;
   }
   out.close();
 }
@@ -245,14 +387,63 @@ void trainNeuralNet(const unsigned int width, const unsigned int height, const s
 }
 
 void dumpErrors(const int width, const int height, const string& fileName) {
-  StateMap_t savedStateMap = loadStateMap(fileName);
-  for (const auto& d : savedStateMap) {
+  StateMapFile savedStateMap;
+  if (!openStateMap(fileName, savedStateMap)) {
+    return;
+  }
+  for (const auto& r : savedStateMap) {
     State s(width, height);
-    s.fromHash(d.first);
-    const int goodness = s.getGoodness(Player::WHITE);
-    if (d.second.bestValue < 0 && goodness > 0 ||
-        d.second.bestValue > 0 && goodness < 0) {
-      cout << d.second.bestValue << " " << goodness << endl;
+    s.fromHash(r.getHash());
+    const int goodness = s.getGoodness(OTHER(s.getCurrTurn()));
+    if (r.bestValue < 0 && goodness > 0 ||
+        r.bestValue > 0 && goodness < 0) {
+      cout << r.bestValue << " " << goodness << endl;
+    }
+  }
+}
+
+// Runs every saved state through the batched net and reports how far it is
+// from FANN's own per-state result.
+void checkBatchedEvaluation(const int width, const int height, const string& fileName) {
+  StateMapFile savedStateMap;
+  if (!openStateMap(fileName, savedStateMap)) {
+    return;
+  }
+  vector<fann_type> inputs;
+  vector<int> expected;
+  for (const auto& r : savedStateMap) {
+    State s(width, height);
+    s.fromHash(r.getHash());
+    inputs.resize(inputs.size() + NNET_NUM_INPUTS);
+    s.getNeuralNetInput(&inputs[inputs.size() - NNET_NUM_INPUTS]);
+    expected.push_back(State::getPredictedGoodness(getNeuralNet().run(&inputs[inputs.size() - NNET_NUM_INPUTS])[0], Player::WHITE));
+  }
+  vector<fann_type> preds(expected.size());
+  getDenseNet().runBatch(inputs.data(), expected.size(), preds.data());
+  int maxError = 0;
+  for (size_t i = 0; i < expected.size(); ++i) {
+    maxError = max(maxError, abs(State::getPredictedGoodness(preds[i], Player::WHITE) - expected[i]));
+  }
+  cout << "states: " << expected.size() << ", max batched error: " << maxError << endl;
+}
+
+// Reports accuracy against FANN and time per evaluation for every native
+// kernel set and precision this CPU supports, and which one the engine uses.
+void checkNativeNet() {
+  FANN::neural_net& net = getNeuralNet();
+  cout << "engine: " << NativeNet(net, NATIVE_NET_PRECISION).describe() << endl;
+  const fann_type input[NNET_NUM_INPUTS] = { 2,0,0,0,1, 1,0,0,0,2, 2,0,0,0,1, 1,0,0,0,2 };
+  for (const auto& kernels : getSupportedNetKernels()) {
+    for (const auto precision : { NetPrecision::FLOAT32, NetPrecision::INT16 }) {
+      NativeNet native(net, precision, kernels);
+      const double maxError = native.measureMaxError(net, NATIVE_NET_ERROR_SAMPLES);
+      Stopwatch stopwatch;
+      fann_type sum = 0;
+      for (int i = 0; i < NATIVE_NET_ERROR_SAMPLES; ++i) {
+        sum += native.run(input);
+      }
+      cout << native.describe() << ": max error " << maxError << ", "
+           << stopwatch.elapsed() / NATIVE_NET_ERROR_SAMPLES * 1e6 << "us per eval (" << sum << ")" << endl;
     }
   }
 }
@@ -261,9 +452,67 @@ void runTests(const int width, const int height, const std::string& fileName) {
   //createTrainData(width, height, fileName);
   //trainNeuralNet(width, height, fileName);
   //dumpErrors(width, height, fileName);
+  //checkBatchedEvaluation(width, height, fileName);
+}
+
+// Searches the opening position with 1, 2, 4, ... threads and reports how
+// deep each got and how nodes/second scales. With Monte Carlo search it does
+// so for both kinds of parallelism and reports playouts/second per thread.
+void benchmarkThreads(const int width, const int height, const int maxDepth, const size_t ttSizeMb, const double timeBudget, const int maxThreads,
+                      const bool useMonteCarlo, const MonteCarloOptions& options) {
+  for (int mode = 0; mode < (useMonteCarlo ? 2 : 1); ++mode) {
+    MonteCarloOptions modeOptions = options;
+    modeOptions.parallelism = static_cast<MonteCarloParallelism>(mode);
+    double baseRate = 0;
+    for (int numThreads = 1; numThreads <= maxThreads; numThreads *= 2) {
+      Game game(width, height, maxDepth, ttSizeMb);
+      game.setTimeBudget(timeBudget);
+      game.setNumThreads(numThreads);
+      game.setUseMonteCarlo(useMonteCarlo);
+      game.setMonteCarloOptions(modeOptions);
+      game.getBestMove();
+      const SearchInfo& info = game.getLastSearch();
+      const double rate = info.nodes / max(info.seconds, 1e-9);
+      if (numThreads == 1) {
+        baseRate = rate;
+      }
+      if (useMonteCarlo) {
+        cout << (mode == MonteCarloParallelism::ROOT_PARALLEL ? "root" : "tree") << " parallel, threads: " << numThreads
+             << ", playouts: " << info.nodes << ", seconds: " << info.seconds << ", playouts/s: " << rate
+             << ", playouts/s per thread: " << rate / numThreads << ", speedup: " << rate / max(baseRate, 1e-9) << endl;
+      } else {
+        cout << "threads: " << numThreads << ", depth: " << info.depth << ", nodes: " << info.nodes
+             << ", seconds: " << info.seconds << ", nodes/s: " << rate
+             << ", speedup: " << rate / max(baseRate, 1e-9) << endl;
+      }
+      if (numThreads < maxThreads && numThreads * 2 > maxThreads) {
+        numThreads = maxThreads / 2;
+      }
+    }
+  }
+}
+
+static void solveTablebase(const int numThreads) {
+  Tablebase tablebase;
+  tablebase.solve(numThreads);
+  if (!tablebase.save(TABLEBASE_FILE)) {
+    cerr << "Unable to write " << TABLEBASE_FILE << endl;
+  }
+}
+
+static shared_ptr<const Tablebase> loadTablebase(const int width, const int height) {
+  if (width != TABLEBASE_WIDTH || height != TABLEBASE_HEIGHT) {
+    return NULL;
+  }
+  shared_ptr<Tablebase> tablebase = make_shared<Tablebase>();
+  if (!tablebase->load(TABLEBASE_FILE)) {
+    return NULL;
+  }
+  cout << "Loaded tablebase: " << TABLEBASE_FILE << endl;
+  return tablebase;
 }
 
-void playServer(const int width, const int height, const int maxDepth, const bool isWhite, const std::string& gameId, const string& hostName, const int port) {
+void playServer(const int width, const int height, const int maxDepth, const size_t ttSizeMb, const double timeBudget, const int numThreads, const bool useMonteCarlo, const MonteCarloOptions& monteCarloOptions, const bool isWhite, const std::string& gameId, const string& hostName, const int port) {
   static const int max_length = 10;
 
   char line[256];
@@ -278,7 +527,12 @@ void playServer(const int width, const int height, const int maxDepth, const boo
   int len = stream->receive(line, sizeof(line));
   line[len] = 0;
 
-  Game game(width, height, maxDepth);
+  Game game(width, height, maxDepth, ttSizeMb);
+  game.setTimeBudget(timeBudget);
+  game.setNumThreads(numThreads);
+  game.setUseMonteCarlo(useMonteCarlo);
+  game.setMonteCarloOptions(monteCarloOptions);
+  game.setTablebase(loadTablebase(width, height));
   const Player player = isWhite ? Player::WHITE : Player::BLACK;
 
   while (game.getWinner() == Player::NONE) {
@@ -321,14 +575,24 @@ int main(int argc, char* const argv[]) {
   bool isGenMode = false;
   bool isPopMode = false;
   bool isTestMode = false;
+  bool isBenchMode = false;
+  bool isSolveMode = false;
+  bool isConvertMode = false;
+  bool isCheckNetMode = false;
+  bool useMonteCarlo = false;
+  MonteCarloOptions monteCarloOptions;
   bool useServer = false;
   int maxDepth = 8;
+  bool isDepthSet = false;
+  double timeBudget = 0;
+  int numThreads = 1;
+  size_t ttSizeMb = DEFAULT_TT_SIZE_MB;
   string stateMapFileName;
   string gameId;
   string hostName = "tr5130gu-10";
   int hostPort = 12345;
   char c = '\0';
-  while ((c = getopt(argc, argv, "abd:glhp:t:s:H:P:")) != -1) {
+  while ((c = getopt(argc, argv, "abBc:d:Egj:lhL:m:Mn:Np:rRt:s:S:H:P:T:")) != -1) {
     switch (c) {
       case 'a':
         isAuto = true;
@@ -339,39 +603,94 @@ int main(int argc, char* const argv[]) {
       case 'P':
         hostPort = atoi(optarg);
         break;
+      case 'T':
+        timeBudget = atof(optarg);
+        break;
       case 'b':
         isWhite = false;
         break;
+      case 'B':
+        isBenchMode = true;
+        break;
+      case 'c':
+        isConvertMode = true;
+        stateMapFileName = optarg;
+        break;
       case 'd':
         maxDepth = atoi(optarg);
+        isDepthSet = true;
+        break;
+      case 'E':
+        isCheckNetMode = true;
         break;
       case 'g':
         isGenMode = true;
         break;
+      case 'j':
+        numThreads = max(1, atoi(optarg));
+        break;
       case 'l':
         isSmallBoard = false;
         break;
+      case 'L':
+        monteCarloOptions.rolloutPlies = max(0, atoi(optarg));
+        break;
+      case 'm':
+        ttSizeMb = atoi(optarg);
+        break;
       case 'h':
         cout << "Usage: " << argv[0] << endl
              << "\t-H <hostname>\tHostname of gameserver. Default is localhost." << endl
              << "\t-P <port>\tPort of gameserver. Default is 12345." << endl
              << "\t-a\t\tAuto-mode. Play against itself." << endl
              << "\t-b\t\tPlay as black. Default is white." << endl
-             << "\t-d <depth>\tMax depth. Default is 8." << endl
+             << "\t-c <statemap>\tConvert a text statemap to <statemap>.bin." << endl
+             << "\t-d <depth>\tMax depth. Default is 8, or unlimited with -T." << endl
+             << "\t-T <seconds>\tTime budget per move. Default is no limit." << endl
+             << "\t-j <threads>\tSearch threads. Default is 1." << endl
              << "\t-l\t\tUse large board. Default is small board." << endl
-             << "\t-g\t\tGenerate states." << endl
-             << "\t-p <statemap>\tPopulate states." << endl
+             << "\t-m <MB>\t\tTransposition table size. Default is " << DEFAULT_TT_SIZE_MB << "." << endl
+             << "\t-M\t\tUse Monte Carlo tree search, -T seconds per move. Default is " << DEFAULT_MC_TIME_BUDGET << "." << endl
+             << "\t-r\t\tRun -M on -j threads with a tree each. Default is one shared tree." << endl
+             << "\t-S <seed>\tSeed -M playouts. Default is a random seed." << endl
+             << "\t-n <playouts>\tRun -M for <playouts> per thread instead of -T seconds." << endl
+             << "\t-N\t\tScore -M leaves with the neural net on the small board. Default is random games." << endl
+             << "\t-L <plies>\tPlay <plies> random moves before each -N evaluation. Default is 0." << endl
+             << "\t-g\t\tGenerate one state per symmetry class using -j threads." << endl
+             << "\t-B\t\tBenchmark search scaling up to -j threads." << endl
+             << "\t-p <states>\tPopulate states into <states>_statemap using -j threads." << endl
+             << "\t-E\t\tCheck the native net against FANN for every kernel set and precision." << endl
+             << "\t-R\t\tSolve the small board into " << TABLEBASE_FILE << " using -j threads." << endl
              << "\t-s <gameID>\tUse game server. Default is false." << endl
              << "\t-h\t\tDisplay this help message." << endl;
         return 1;
+      case 'M':
+        useMonteCarlo = true;
+        break;
+      case 'n':
+        monteCarloOptions.playouts = atoll(optarg);
+        break;
+      case 'N':
+        monteCarloOptions.useNet = true;
+        break;
       case 'p':
         isPopMode = true;
         stateMapFileName = optarg;
         break;
+      case 'r':
+        monteCarloOptions.parallelism = MonteCarloParallelism::ROOT_PARALLEL;
+        break;
+      case 'R':
+        isSolveMode = true;
+        break;
       case 's':
         useServer = true;
         gameId = optarg;
         break;
+      case 'S':
+        monteCarloOptions.isSeeded = true;
+        monteCarloOptions.seed = strtoul(optarg, NULL, 10);
+        break;
       case 't':
         isTestMode = true;
         stateMapFileName = optarg;
@@ -380,7 +699,16 @@ int main(int argc, char* const argv[]) {
   }
   cout << "isWhite: " << isWhite << endl;
   cout << "isSmallBoard: " << isSmallBoard << endl;
+  // threat extensions can take a line MAX_THREAT_EXTENSIONS plies past maxDepth,
+  // and mate scores and killers only cover MAX_PLY plies from the root
+  const int depthLimit = MAX_PLY - 1 - MAX_THREAT_EXTENSIONS;
+  if (timeBudget > 0 && !isDepthSet) {
+    maxDepth = depthLimit;
+  }
+  maxDepth = min(maxDepth, depthLimit);
   cout << "maxDepth: " << maxDepth << endl;
+  cout << "timeBudget: " << timeBudget << endl;
+  cout << "numThreads: " << numThreads << endl;
 
   int width = 5;
   int height = 4;
@@ -390,20 +718,37 @@ int main(int argc, char* const argv[]) {
   }
 
   if (isGenMode) {
-    generateStates(width, height);
+    generateStates(width, height, numThreads);
     return 0;
   } else if (isPopMode) {
-    populateStates(width, height, maxDepth, stateMapFileName);
+    populateStates(width, height, maxDepth, ttSizeMb, numThreads, stateMapFileName);
+    return 0;
+  } else if (isConvertMode) {
+    convertStateMap(width, height, stateMapFileName);
+    return 0;
+  } else if (isCheckNetMode) {
+    checkNativeNet();
+    return 0;
+  } else if (isSolveMode) {
+    solveTablebase(numThreads);
+    return 0;
+  } else if (isBenchMode) {
+    benchmarkThreads(width, height, maxDepth, ttSizeMb, timeBudget, numThreads, useMonteCarlo, monteCarloOptions);
     return 0;
   } else if (isTestMode) {
     runTests(width, height, stateMapFileName);
     return 0;
   } else if (useServer) {
-    playServer(width, height, maxDepth, isWhite, gameId, hostName, hostPort);
+    playServer(width, height, maxDepth, ttSizeMb, timeBudget, numThreads, useMonteCarlo, monteCarloOptions, isWhite, gameId, hostName, hostPort);
     return 0;
   }
 
-  Game game(width, height, maxDepth);
+  Game game(width, height, maxDepth, ttSizeMb);
+  game.setTimeBudget(timeBudget);
+  game.setNumThreads(numThreads);
+  game.setUseMonteCarlo(useMonteCarlo);
+  game.setMonteCarloOptions(monteCarloOptions);
+  game.setTablebase(loadTablebase(width, height));
   const Player player = isWhite ? Player::WHITE : Player::BLACK;
   while (game.getWinner() == Player::NONE) {
     cout << endl << endl << "turn#: " << game.getNumTurns() << (game.getCurrTurn() == Player::WHITE ? " (W)" : " (B)") << endl;